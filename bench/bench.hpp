@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+
+class bench_timer
+{
+public:
+    bench_timer() : start(clock::now()) {}
+
+    double elapsed_ns() const
+    {
+        return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+    clock::time_point start;
+};
+
+// keep the compiler from optimizing away results of benchmarked code
+template <class T>
+static inline void do_not_optimize(T const &val)
+{
+    asm volatile("" : : "r,m"(val) : "memory");
+}
+
+#define BENCH_HEADER(title) \
+    printf("\n%s\n", title);
+
+#define BENCH_RESULT(fmt, ...) \
+    printf("    " fmt "\n", ##__VA_ARGS__);
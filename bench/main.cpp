@@ -0,0 +1,668 @@
+#include "bench.hpp"
+#include "workloads.hpp"
+#include <heap.hpp>
+#include <concurrent_heap.hpp>
+#include <arena_heap.hpp>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// before Linux 4.17 and glibc 2.28 the address is only a hint, callers
+// compare it with the result
+#ifndef MAP_FIXED_NOREPLACE
+    #define MAP_FIXED_NOREPLACE 0
+#endif
+
+static constexpr size_t PAGE_SIZE {4096};
+
+template<size_t ALIGNMENT = 16, unsigned MODE = HEAP_MODE_DEFAULT, class FIT = first_fit>
+class bench_ctx
+{
+public:
+    bench_ctx(size_t size) :
+        buffer(size + ALIGNMENT),
+        mem((reinterpret_cast<size_t>(buffer.data()) + ALIGNMENT - 1) & ~(ALIGNMENT - 1), size),
+        heap(mem)
+    {
+    }
+
+private:
+    std::vector<char> buffer;
+public:
+    fixed_memory mem;
+    first_fit_heap<ALIGNMENT, MODE, FIT> heap;
+};
+
+// Wraps a fit policy and counts the blocks its searches visit
+template <class FIT>
+struct counted : FIT
+{
+    static void visit() { visits++; }
+
+    static size_t visits;
+};
+
+template <class FIT>
+size_t counted<FIT>::visits {0};
+
+// Largest block the heap can currently hand out
+template <class HEAP>
+static size_t largest_free_block(HEAP &heap)
+{
+    size_t lo {0}, hi {heap.free_mem()};
+
+    while (lo < hi) {
+        const size_t mid {(lo + hi + 1) / 2};
+        void *p = heap.alloc(mid);
+
+        if (p) {
+            heap.free(p);
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
+}
+
+// Random churn around a steady live set, then report how long the
+// searches were and how fragmented the heap ended up.
+template <class FIT>
+static void fit_policy(const char *name)
+{
+    static constexpr size_t HEAP_SIZE {4 << 20};
+    static constexpr size_t LIVE      {4096};
+    static constexpr size_t OPS       {200000};
+
+    bench_ctx<16, HEAP_MODE_DEFAULT, counted<FIT>> ctx(HEAP_SIZE);
+    std::mt19937 rng(42);
+    std::vector<void *> live;
+    size_t allocs {0}, failed {0};
+
+    counted<FIT>::visits = 0;
+    bench_timer timer;
+
+    for (size_t op = 0; op < OPS; op++) {
+        if (live.size() < LIVE or rng() % 2) {
+            const size_t size {rng() % 8 ? 16 + rng() % 240 : 256 + rng() % 3840};
+            void *p = ctx.heap.alloc(size);
+
+            allocs++;
+            if (p) {
+                live.push_back(p);
+            } else {
+                failed++;
+            }
+        } else {
+            const size_t idx {rng() % live.size()};
+            ctx.heap.free(live[idx]);
+            live[idx] = live.back();
+            live.pop_back();
+        }
+    }
+
+    const double ns {timer.elapsed_ns()};
+    const size_t free_mem {ctx.heap.free_mem()};
+    const size_t largest {largest_free_block(ctx.heap)};
+
+    BENCH_RESULT("%-12s %12.1f %12.1f %12zu %12zu %12.3f", name,
+                 static_cast<double>(counted<FIT>::visits) / allocs, ns / OPS,
+                 ctx.heap.num_blocks(), failed,
+                 free_mem ? 1. - static_cast<double>(largest) / free_mem : 0.);
+}
+
+// Free latency with a growing number of free fragments in front of the
+// freed blocks. The address ordered list has to be walked up to the
+// position of every freed block, the doubly linked list never walks.
+template <unsigned MODE>
+static double free_latency(size_t fragments)
+{
+    static constexpr size_t HOLE_SIZE  {32};
+    static constexpr size_t BLOCK_SIZE {64};
+    static constexpr size_t BLOCKS     {256};
+    static constexpr size_t ROUNDS     {16};
+
+    bench_ctx<16, MODE> ctx((fragments * 2 + BLOCKS) * (BLOCK_SIZE + 16) + PAGE_SIZE);
+
+    std::vector<void *> holes;
+    for (size_t i = 0; i < fragments * 2; i++) {
+        holes.push_back(ctx.heap.alloc(HOLE_SIZE));
+    }
+    for (size_t i = 0; i < holes.size(); i += 2) {
+        ctx.heap.free(holes[i]);
+    }
+
+    std::vector<void *> blocks(BLOCKS);
+    double total_ns {0};
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        for (auto &p : blocks) {
+            p = ctx.heap.alloc(BLOCK_SIZE);
+            do_not_optimize(p);
+        }
+
+        bench_timer timer;
+        for (auto *p : blocks) {
+            ctx.heap.free(p);
+        }
+        total_ns += timer.elapsed_ns();
+    }
+
+    return total_ns / (ROUNDS * BLOCKS);
+}
+
+// Free a random block and allocate the same size again, with a number of
+// small blocks live around it. Without deferred frees every pair merges
+// the block into its neighbours and splits it off again.
+template <unsigned MODE>
+static double free_alloc_cycle(size_t live)
+{
+    static constexpr size_t PAIRS {200000};
+
+    bench_ctx<16, MODE> ctx(live * 256 + PAGE_SIZE);
+    std::mt19937 rng(3);
+    std::vector<void *> blocks(live);
+    std::vector<size_t> sizes(live);
+
+    for (size_t i = 0; i < live; i++) {
+        sizes[i]  = 16 + rng() % 8 * 16;
+        blocks[i] = ctx.heap.alloc(sizes[i]);
+    }
+
+    bench_timer timer;
+
+    for (size_t i = 0; i < PAIRS; i++) {
+        const size_t idx {rng() % live};
+
+        ctx.heap.free(blocks[idx]);
+        blocks[idx] = ctx.heap.alloc(sizes[idx]);
+        do_not_optimize(blocks[idx]);
+    }
+
+    return timer.elapsed_ns() / PAIRS;
+}
+
+// Share of a heap filled with objects of one size that is not payload
+template <unsigned MODE>
+static double overhead(size_t size)
+{
+    static constexpr size_t HEAP_SIZE {4 << 20};
+
+    bench_ctx<16, MODE> ctx(HEAP_SIZE);
+    size_t objects {0};
+
+    while (ctx.heap.alloc(size)) {
+        objects++;
+    }
+
+    return 100. * (1. - static_cast<double>(objects * size) / HEAP_SIZE);
+}
+
+// Alloc/free pairs on a region at a fixed address, once through the virtual
+// memory interface and once with the bounds known at compile time
+static constexpr size_t STATIC_SIZE {16ul << 20};
+
+template <unsigned MODE, class MEMORY>
+static double memory_dispatch(MEMORY &mem)
+{
+    static constexpr size_t OPS {1 << 21};
+
+    first_fit_heap<16, MODE, first_fit, MEMORY> heap(mem);
+    std::vector<void *> ptrs(4096);
+    std::vector<uint32_t> slots(OPS);
+    std::mt19937 rng(1);
+
+    for (auto &slot : slots) {
+        slot = rng() % ptrs.size();
+    }
+
+    bench_timer timer;
+
+    for (size_t i = 0; i < OPS; i++) {
+        auto *&p = ptrs[slots[i]];
+
+        if (p) {
+            heap.free(p);
+            p = nullptr;
+        } else {
+            p = heap.alloc(16 + (slots[i] & 255));
+            do_not_optimize(p);
+        }
+    }
+
+    const double ns {timer.elapsed_ns() / OPS};
+
+    for (auto *p : ptrs) {
+        heap.free(p);
+    }
+
+    return ns;
+}
+
+template <unsigned MODE, size_t BASE>
+static void memory_dispatch(const char *name)
+{
+    fixed_memory runtime(BASE, STATIC_SIZE);
+    static_memory<BASE, STATIC_SIZE> compile_time;
+
+    BENCH_RESULT("%-14s %12.1f %12.1f", name, memory_dispatch<MODE, memory>(runtime), memory_dispatch<MODE>(compile_time));
+}
+
+// Both comparisons on a region mapped at BASE, false if the address is taken
+template <size_t BASE>
+static bool memory_dispatch_at()
+{
+    void *region = mmap(reinterpret_cast<void *>(BASE), STATIC_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (region != reinterpret_cast<void *>(BASE)) {
+        if (region != MAP_FAILED) {
+            munmap(region, STATIC_SIZE);
+        }
+
+        return false;
+    }
+
+    memory_dispatch<HEAP_MODE_DEFAULT, BASE>("default");
+    memory_dispatch<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED, BASE>("binned+doubly");
+    munmap(region, STATIC_SIZE);
+    return true;
+}
+
+// Best fit for large blocks over a growing number of free fragments, the
+// list search visits every fragment, the index only a tree path.
+template <unsigned MODE>
+static void large_best_fit(size_t fragments, double &ns, double &visits)
+{
+    static constexpr size_t ROUNDS {256};
+
+    using FIT = counted<best_fit>;
+    bench_ctx<16, MODE, FIT> ctx(fragments * 2 * (9 << 10) + (ROUNDS << 15));
+    std::mt19937 rng(7);
+
+    std::vector<void *> holes;
+    for (size_t i = 0; i < fragments * 2; i++) {
+        holes.push_back(ctx.heap.alloc(1024 + rng() % (7 << 10)));
+    }
+    // back to front, so the address ordered list never has to be walked
+    for (size_t i = holes.size(); i > 0; i -= 2) {
+        ctx.heap.free(holes[i - 2]);
+    }
+
+    std::vector<void *> blocks;
+    FIT::visits = 0;
+    ns          = 0;
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        const size_t size {1024 + rng() % (15 << 10)};
+
+        bench_timer timer;
+        void *p = ctx.heap.alloc(size);
+        ns += timer.elapsed_ns();
+
+        blocks.push_back(p);
+    }
+
+    visits = static_cast<double>(FIT::visits) / ROUNDS;
+    ns    /= ROUNDS;
+
+    for (auto *p : blocks) {
+        ctx.heap.free(p);
+    }
+}
+
+// Several buffers growing by 1.5x in turns like std::vector does, either
+// through realloc or through alloc/copy/free. Reports ns per growth step and
+// the share of realloc calls that did not have to move the data.
+template <bool REALLOC>
+static void vector_growth(size_t buffers, double &ns, double &in_place)
+{
+    static constexpr size_t HEAP_SIZE {64 << 20};
+    static constexpr size_t MAX_SIZE  {256 << 10};
+
+    bench_ctx<> ctx(HEAP_SIZE);
+    std::vector<void *> ptrs(buffers, nullptr);
+    std::vector<size_t> sizes(buffers, 16);
+    size_t steps {0}, unmoved {0};
+
+    bench_timer timer;
+
+    for (bool grown = true; grown;) {
+        grown = false;
+
+        for (size_t i = 0; i < buffers; i++) {
+            if (sizes[i] >= MAX_SIZE) {
+                continue;
+            }
+
+            const size_t size {sizes[i] + sizes[i] / 2};
+            void *p;
+
+            if (REALLOC) {
+                p = ctx.heap.realloc(ptrs[i], size);
+            } else {
+                p = ctx.heap.alloc(size);
+                if (p and ptrs[i]) {
+                    memcpy(p, ptrs[i], sizes[i]);
+                    ctx.heap.free(ptrs[i]);
+                }
+            }
+
+            do_not_optimize(p);
+            unmoved += p == ptrs[i];
+            ptrs[i]  = p;
+            sizes[i] = size;
+            grown    = true;
+            steps++;
+        }
+    }
+
+    ns       = timer.elapsed_ns() / steps;
+    in_place = 100. * unmoved / steps;
+
+    for (auto *p : ptrs) {
+        ctx.heap.free(p);
+    }
+}
+
+// The heap behind one global mutex, what users had to do before
+// concurrent_heap existed
+template <class HEAP>
+class mutex_heap
+{
+public:
+    mutex_heap(memory &mem) : heap(mem) {}
+
+    void *alloc(size_t size)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return heap.alloc(size);
+    }
+
+    void free(void *p)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        heap.free(p);
+    }
+
+private:
+    std::mutex lock;
+    HEAP heap;
+};
+
+// Million small alloc/free pairs per second with all threads working on
+// one shared heap
+template <class HEAP>
+static double scalability(size_t threads)
+{
+    static constexpr size_t ROUNDS {20000};
+    static constexpr size_t BATCH  {8};
+
+    std::vector<char> buffer(64 << 20);
+    fixed_memory mem((reinterpret_cast<size_t>(buffer.data()) + 15) & ~15ul, (64 << 20) - 16);
+    HEAP heap(mem);
+
+    auto worker = [&heap](unsigned seed) {
+        std::mt19937 rng(seed);
+        void *ptrs[BATCH];
+
+        for (size_t round = 0; round < ROUNDS; round++) {
+            for (auto &p : ptrs) {
+                p = heap.alloc(16 + rng() % 240);
+                do_not_optimize(p);
+            }
+            for (auto *p : ptrs) {
+                heap.free(p);
+            }
+        }
+    };
+
+    bench_timer timer;
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(worker, i);
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    return threads * ROUNDS * BATCH / timer.elapsed_ns() * 1e3;
+}
+
+static workload (*const workload_makers[])(size_t) {
+    lifo_workload, fifo_workload, churn_workload, producer_consumer_workload, mixed_workload, power_law_workload,
+};
+
+static const char *const allocators[] {"glibc", "first-fit", "binned", "indexed"};
+
+static bool run_workload(size_t allocator, const workload &w, workload_result &r)
+{
+    switch (allocator) {
+    case 0:  return run_workload<malloc_allocator>(w, r);
+    case 1:  return run_workload<heap_allocator<first_fit_heap<>>>(w, r);
+    case 2:  return run_workload<heap_allocator<first_fit_heap<16, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>>>(w, r);
+    default: return run_workload<heap_allocator<first_fit_heap<16, HEAP_MODE_INDEXED, best_fit>>>(w, r);
+    }
+}
+
+// Every workload and allocator runs in a process of its own started through
+// --run-one, which prints the result as one line.
+static bool run_isolated(size_t workload_idx, size_t allocator, size_t ops, workload_result &r)
+{
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "/proc/%d/exe --run-one %zu %zu --ops %zu", getpid(), workload_idx, allocator, ops);
+
+    FILE *child = popen(cmd, "r");
+    if (not child) {
+        return false;
+    }
+
+    const int fields = fscanf(child, "%lf %lf %lf %lf %zu %lf", &r.ops_per_sec, &r.p50, &r.p99, &r.p999,
+                              &r.peak_footprint, &r.fragmentation);
+
+    return pclose(child) == 0 and fields == 6;
+}
+
+// Output of the workload suite for scripts, selected on the command line
+struct report
+{
+    FILE *csv  {nullptr};
+    FILE *json {nullptr};
+    bool  first_json {true};
+};
+
+static void workload_row(report &out, const workload &w, const char *allocator, const workload_result &r)
+{
+    BENCH_RESULT("%-12s %-10s %10.2f %8.0f %8.0f %8.0f %10zu %8.3f", w.name.c_str(), allocator,
+                 r.ops_per_sec / 1e6, r.p50, r.p99, r.p999, r.peak_footprint >> 10, r.fragmentation);
+
+    if (out.csv) {
+        fprintf(out.csv, "%s,%s,%.0f,%.0f,%.0f,%.0f,%zu,%.4f\n", w.name.c_str(), allocator,
+                r.ops_per_sec, r.p50, r.p99, r.p999, r.peak_footprint, r.fragmentation);
+    }
+
+    if (out.json) {
+        fprintf(out.json, "%s\n  {\"workload\": \"%s\", \"allocator\": \"%s\", \"ops_per_sec\": %.0f, "
+                "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f, \"peak_footprint\": %zu, \"fragmentation\": %.4f}",
+                out.first_json ? "" : ",", w.name.c_str(), allocator,
+                r.ops_per_sec, r.p50, r.p99, r.p999, r.peak_footprint, r.fragmentation);
+        out.first_json = false;
+    }
+}
+
+static void workloads(report &out, size_t ops)
+{
+    BENCH_HEADER("workloads [Mops/s, ns per call, KiB peak footprint, share of the footprint not live]");
+    BENCH_RESULT("%-12s %-10s %10s %8s %8s %8s %10s %8s", "workload", "allocator", "Mops/s", "p50", "p99", "p999", "peak KiB", "frag");
+
+    if (out.csv) {
+        fprintf(out.csv, "workload,allocator,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_footprint,fragmentation\n");
+    }
+
+    if (out.json) {
+        fprintf(out.json, "[");
+    }
+
+    for (size_t i = 0; i < sizeof(workload_makers) / sizeof(workload_makers[0]); i++) {
+        const workload w {workload_makers[i](ops)};
+
+        for (size_t allocator = 0; allocator < sizeof(allocators) / sizeof(allocators[0]); allocator++) {
+            workload_result r;
+
+            if (run_isolated(i, allocator, ops, r)) {
+                workload_row(out, w, allocators[allocator], r);
+            } else {
+                BENCH_RESULT("%-12s %-10s failed", w.name.c_str(), allocators[allocator]);
+            }
+        }
+    }
+
+    if (out.json) {
+        fprintf(out.json, "\n]\n");
+    }
+}
+
+// first-fit-heap-bench [--csv FILE] [--json FILE] [--ops N] [--workloads-only]
+int main(int argc, char **argv)
+{
+    report out;
+    size_t ops {200000};
+    bool   workloads_only {false};
+    long   run_one[2] {-1, -1};
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg {argv[i]};
+
+        if (arg == "--csv" and i + 1 < argc) {
+            out.csv = fopen(argv[++i], "w");
+        } else if (arg == "--json" and i + 1 < argc) {
+            out.json = fopen(argv[++i], "w");
+        } else if (arg == "--ops" and i + 1 < argc) {
+            ops = strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--workloads-only") {
+            workloads_only = true;
+        } else if (arg == "--run-one" and i + 2 < argc) {
+            run_one[0] = strtol(argv[++i], nullptr, 0);
+            run_one[1] = strtol(argv[++i], nullptr, 0);
+        } else {
+            fprintf(stderr, "usage: %s [--csv FILE] [--json FILE] [--ops N] [--workloads-only]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (run_one[0] >= 0) {
+        workload_result r {};
+
+        if (not run_workload(run_one[1], workload_makers[run_one[0]](ops), r)) {
+            return 1;
+        }
+
+        printf("%f %f %f %f %zu %f\n", r.ops_per_sec, r.p50, r.p99, r.p999, r.peak_footprint, r.fragmentation);
+        return 0;
+    }
+
+    workloads(out, ops);
+
+    for (FILE *f : {out.csv, out.json}) {
+        if (f) {
+            fclose(f);
+        }
+    }
+
+    if (workloads_only) {
+        return 0;
+    }
+
+    BENCH_HEADER("free latency [ns/free] by number of free fragments");
+    BENCH_RESULT("%10s %12s %12s %14s", "fragments", "default", "doubly", "binned+doubly");
+
+    for (size_t fragments = 64; fragments <= 16384; fragments *= 4) {
+        BENCH_RESULT("%10zu %12.1f %12.1f %14.1f", fragments,
+                     free_latency<HEAP_MODE_DEFAULT>(fragments),
+                     free_latency<HEAP_MODE_DOUBLY_LINKED>(fragments),
+                     free_latency<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>(fragments));
+    }
+
+    BENCH_HEADER("free then alloc of the same size [ns/pair] by number of live blocks");
+    BENCH_RESULT("%10s %12s %12s %14s %14s", "live", "default", "deferred", "binned+doubly", "deferred b+d");
+
+    for (size_t live = 64; live <= 16384; live *= 4) {
+        BENCH_RESULT("%10zu %12.1f %12.1f %14.1f %14.1f", live,
+                     free_alloc_cycle<HEAP_MODE_DEFAULT>(live),
+                     free_alloc_cycle<HEAP_MODE_DEFERRED>(live),
+                     free_alloc_cycle<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>(live),
+                     free_alloc_cycle<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED | HEAP_MODE_DEFERRED>(live));
+    }
+
+    BENCH_HEADER("fit policies under random churn");
+    BENCH_RESULT("%-12s %12s %12s %12s %12s %12s", "policy", "visits/alloc", "ns/op", "free blocks", "failed", "frag");
+
+    fit_policy<first_fit>("first fit");
+    fit_policy<next_fit>("next fit");
+    fit_policy<best_fit>("best fit");
+    fit_policy<good_fit<4>>("good fit 4");
+    fit_policy<good_fit<16>>("good fit 16");
+
+    BENCH_HEADER("large block best fit [ns/alloc, visits/alloc] by number of free fragments");
+    BENCH_RESULT("%10s %12s %12s %12s %12s", "fragments", "list ns", "list visits", "index ns", "index visits");
+
+    for (size_t fragments = 1024; fragments <= 16384; fragments *= 4) {
+        double list_ns, list_visits, index_ns, index_visits;
+
+        large_best_fit<HEAP_MODE_DEFAULT>(fragments, list_ns, list_visits);
+        large_best_fit<HEAP_MODE_INDEXED>(fragments, index_ns, index_visits);
+
+        BENCH_RESULT("%10zu %12.1f %12.1f %12.1f %12.1f", fragments, list_ns, list_visits, index_ns, index_visits);
+    }
+
+    BENCH_HEADER("vector style growth [ns/step] by number of growing buffers");
+    BENCH_RESULT("%10s %12s %12s %12s", "buffers", "copy", "realloc", "in place %");
+
+    for (size_t buffers = 1; buffers <= 64; buffers *= 4) {
+        double copy_ns, realloc_ns, copy_in_place, in_place;
+
+        vector_growth<false>(buffers, copy_ns, copy_in_place);
+        vector_growth<true>(buffers, realloc_ns, in_place);
+
+        BENCH_RESULT("%10zu %12.1f %12.1f %12.1f", buffers, copy_ns, realloc_ns, in_place);
+    }
+
+    BENCH_HEADER("memory density [% overhead] by object size");
+    BENCH_RESULT("%10s %12s %12s %14s %14s", "size", "default", "compact", "binned+doubly", "compact b+d");
+
+    for (size_t size : {16, 24, 32, 40, 48, 64, 128}) {
+        BENCH_RESULT("%10zu %12.1f %12.1f %14.1f %14.1f", size,
+                     overhead<HEAP_MODE_DEFAULT>(size),
+                     overhead<HEAP_MODE_COMPACT>(size),
+                     overhead<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>(size),
+                     overhead<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED | HEAP_MODE_COMPACT>(size));
+    }
+
+    BENCH_HEADER("memory interface [ns/op] for alloc/free pairs");
+    BENCH_RESULT("%-14s %12s %12s", "mode", "virtual", "static");
+
+    // the same low addresses as the test, sanitizers and kernels with a
+    // small address space leave them to the application
+    if (not memory_dispatch_at<0x10000000ul>()) {
+        memory_dispatch_at<0x2000000000ul>();
+    }
+
+    BENCH_HEADER("small alloc/free pairs [Mops/s] by number of threads");
+    BENCH_RESULT("%10s %12s %12s %12s", "threads", "mutex", "concurrent", "arenas");
+
+    const size_t max_threads {std::max(4u, std::thread::hardware_concurrency())};
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        BENCH_RESULT("%10zu %12.2f %12.2f %12.2f", threads,
+                     scalability<mutex_heap<first_fit_heap<>>>(threads),
+                     scalability<concurrent_heap<first_fit_heap<>>>(threads),
+                     scalability<arena_heap<first_fit_heap<>>>(threads));
+    }
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "bench.hpp"
+#include <heap.hpp>
+#include <heap_trace.hpp>
+#include <growable_memory.hpp>
+#include <string>
+#include <vector>
+
+// Replays a trace recorded by traced_heap against heap configurations and
+// reports the time taken and how fragmentation develops over the trace.
+//
+//     first-fit-heap-replay TRACE [CONFIG...] [--samples N]
+
+template <class HEAP>
+static void replay(const char *name, const std::vector<heap_trace_record> &records, size_t samples)
+{
+    growable_memory mem(1ul << 36, 1 << 20);
+    HEAP heap(mem);
+    std::vector<void *> blocks;
+    size_t failed {0};
+    double ns {0};
+
+    BENCH_HEADER(name);
+    BENCH_RESULT("%12s %12s %12s %12s %10s", "ops", "used KiB", "free KiB", "largest KiB", "frag");
+
+    const size_t every {records.size() / samples + 1};
+
+    for (size_t i = 0; i < records.size(); i++) {
+        auto &r = records[i];
+
+        if (r.handle >= blocks.size()) {
+            blocks.resize(r.handle + 1);
+        }
+
+        bench_timer timer;
+
+        switch (r.op) {
+        case heap_trace_record::ALLOC:
+            blocks[r.handle] = heap.alloc(r.size);
+            failed += not blocks[r.handle];
+            break;
+        case heap_trace_record::REALLOC:
+            blocks[r.handle] = heap.realloc(blocks[r.handle], r.size);
+            failed += not blocks[r.handle];
+            break;
+        default:
+            heap.free(blocks[r.handle]);
+            blocks[r.handle] = nullptr;
+        }
+
+        ns += timer.elapsed_ns();
+
+        if (i % every == every - 1 or i + 1 == records.size()) {
+            const auto stats = heap.stats();
+
+            BENCH_RESULT("%12zu %12zu %12zu %12zu %10.3f", i + 1, stats.used_bytes >> 10, stats.free_bytes >> 10,
+                         heap.largest_free_block() >> 10, heap.fragmentation());
+        }
+    }
+
+    BENCH_RESULT("%.1f ns/op, %zu failed, %zu KiB committed", ns / records.size(), failed, mem.size() >> 10);
+}
+
+struct config
+{
+    const char *name;
+    void (*run)(const char *, const std::vector<heap_trace_record> &, size_t);
+};
+
+static const config configs[] {
+    {"default",        replay<first_fit_heap<16>>},
+    {"default-64",     replay<first_fit_heap<64>>},
+    {"next-fit",       replay<first_fit_heap<16, HEAP_MODE_DEFAULT, next_fit>>},
+    {"best-fit",       replay<first_fit_heap<16, HEAP_MODE_DEFAULT, best_fit>>},
+    {"good-fit",       replay<first_fit_heap<16, HEAP_MODE_DEFAULT, good_fit<16>>>},
+    {"binned",         replay<first_fit_heap<16, HEAP_MODE_BINNED>>},
+    {"doubly",         replay<first_fit_heap<16, HEAP_MODE_DOUBLY_LINKED>>},
+    {"binned-doubly",  replay<first_fit_heap<16, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>>},
+    {"binned-doubly-64", replay<first_fit_heap<64, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>>},
+    {"indexed",        replay<first_fit_heap<16, HEAP_MODE_INDEXED, best_fit>>},
+};
+
+int main(int argc, char **argv)
+{
+    std::vector<heap_trace_record> records;
+    std::vector<std::string> selected;
+    size_t samples {10};
+
+    for (int i = 2; i < argc; i++) {
+        const std::string arg {argv[i]};
+
+        if (arg == "--samples" and i + 1 < argc) {
+            samples = strtoul(argv[++i], nullptr, 0);
+        } else {
+            selected.push_back(arg);
+        }
+    }
+
+    if (argc < 2 or not read_heap_trace(argv[1], records)) {
+        fprintf(stderr, "usage: %s TRACE [CONFIG...] [--samples N]\nconfigs:", argv[0]);
+        for (auto &c : configs) {
+            fprintf(stderr, " %s", c.name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    printf("%zu records\n", records.size());
+
+    for (auto &c : configs) {
+        if (selected.empty() or std::find(selected.begin(), selected.end(), c.name) != selected.end()) {
+            c.run(c.name, records, samples ? samples : 1);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include "bench.hpp"
+#include <heap.hpp>
+#include <growable_memory.hpp>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+#include <malloc.h>
+#include <stdlib.h>
+
+// A workload is a fixed sequence of allocations and frees on numbered
+// slots, generated once and replayed against every allocator.
+struct workload
+{
+    struct op
+    {
+        uint32_t slot;
+        uint32_t size;   // 0 frees the slot
+    };
+
+    std::string     name;
+    size_t          slots {0};
+    std::vector<op> ops;
+
+    void alloc(uint32_t slot, uint32_t size) { ops.push_back({slot, size}); }
+    void free(uint32_t slot)                 { ops.push_back({slot, 0}); }
+};
+
+// Sizes between 16 and 64 KiB, most of them small
+static uint32_t power_law_size(std::mt19937 &rng)
+{
+    const double u {std::uniform_real_distribution<double>(1e-6, 1.)(rng)};
+    return std::min(16. * std::pow(u, -1. / 1.2), 65536.);
+}
+
+static uint32_t uniform_size(std::mt19937 &rng, uint32_t min, uint32_t max)
+{
+    return min + rng() % (max - min + 1);
+}
+
+// stack-like: allocate a batch, free it in reverse order
+static workload lifo_workload(size_t ops)
+{
+    workload w {"lifo", 1024, {}};
+    std::mt19937 rng(1);
+
+    while (w.ops.size() < ops) {
+        const uint32_t depth = 1 + rng() % w.slots;
+
+        for (uint32_t slot = 0; slot < depth; slot++) {
+            w.alloc(slot, uniform_size(rng, 16, 512));
+        }
+        for (uint32_t slot = depth; slot-- > 0;) {
+            w.free(slot);
+        }
+    }
+
+    return w;
+}
+
+// queue-like: a window of allocations, the oldest one is freed first
+static workload fifo_workload(size_t ops)
+{
+    workload w {"fifo", 4096, {}};
+    std::mt19937 rng(2);
+
+    for (uint32_t n = 0; w.ops.size() < ops; n++) {
+        if (n >= w.slots) {
+            w.free(n % w.slots);
+        }
+        w.alloc(n % w.slots, uniform_size(rng, 16, 1024));
+    }
+
+    return w;
+}
+
+// random sizes and lifetimes around a steady live set
+static workload churn_workload(size_t ops)
+{
+    workload w {"churn", 8192, {}};
+    std::mt19937 rng(3);
+    std::vector<bool> used(w.slots);
+
+    while (w.ops.size() < ops) {
+        const uint32_t slot = rng() % w.slots;
+
+        if (used[slot]) {
+            w.free(slot);
+        } else {
+            w.alloc(slot, uniform_size(rng, 16, 4096));
+        }
+
+        used[slot] = not used[slot];
+    }
+
+    return w;
+}
+
+// Messages handed over through a queue: a producer allocates bursts, the
+// consumer frees them later in order, both interleaved in one thread.
+static workload producer_consumer_workload(size_t ops)
+{
+    workload w {"prod/cons", 16384, {}};
+    std::mt19937 rng(4);
+    std::deque<uint32_t> queue;
+    uint32_t next {0};
+
+    while (w.ops.size() < ops) {
+        const uint32_t produce = rng() % 64;
+        const uint32_t consume = rng() % 64;
+
+        for (uint32_t i = 0; i < produce and queue.size() < w.slots; i++) {
+            w.alloc(next, rng() % 4 ? uniform_size(rng, 32, 256) : uniform_size(rng, 1024, 8192));
+            queue.push_back(next);
+            next = (next + 1) % w.slots;
+        }
+        for (uint32_t i = 0; i < consume and not queue.empty(); i++) {
+            w.free(queue.front());
+            queue.pop_front();
+        }
+    }
+
+    return w;
+}
+
+// A growing set of long-lived objects between short-lived ones
+static workload mixed_workload(size_t ops)
+{
+    workload w {"mixed", 32768, {}};
+    std::mt19937 rng(5);
+    const uint32_t short_slots {1024};
+    std::vector<bool> used(short_slots);
+    uint32_t long_lived {short_slots};
+
+    while (w.ops.size() < ops) {
+        if (rng() % 16 == 0 and long_lived < w.slots) {
+            w.alloc(long_lived++, uniform_size(rng, 64, 2048));
+            continue;
+        }
+
+        const uint32_t slot = rng() % short_slots;
+
+        if (used[slot]) {
+            w.free(slot);
+        } else {
+            w.alloc(slot, uniform_size(rng, 16, 1024));
+        }
+
+        used[slot] = not used[slot];
+    }
+
+    return w;
+}
+
+// churn with a power-law size distribution
+static workload power_law_workload(size_t ops)
+{
+    workload w {"power-law", 8192, {}};
+    std::mt19937 rng(6);
+    std::vector<bool> used(w.slots);
+
+    while (w.ops.size() < ops) {
+        const uint32_t slot = rng() % w.slots;
+
+        if (used[slot]) {
+            w.free(slot);
+        } else {
+            w.alloc(slot, power_law_size(rng));
+        }
+
+        used[slot] = not used[slot];
+    }
+
+    return w;
+}
+
+// glibc malloc as the baseline. Its footprint comes from mallinfo2, or
+// mallinfo before glibc 2.33, and is counted from construction.
+class malloc_allocator
+{
+public:
+    malloc_allocator() : base(mapped()) {}
+
+    void *alloc(size_t size) { return malloc(size); }
+    void  free(void *p)      { ::free(p); }
+
+    size_t footprint() const
+    {
+        const size_t now {mapped()};
+        return now > base ? now - base : 0;
+    }
+
+private:
+    static size_t mapped()
+    {
+#if __GLIBC_PREREQ(2, 33)
+        const auto info = mallinfo2();
+        return info.arena + info.hblkhd;
+#else
+        // the int fields wrap beyond 4 GiB
+        const auto info = mallinfo();
+        return size_t {static_cast<unsigned>(info.arena)} + static_cast<unsigned>(info.hblkhd);
+#endif
+    }
+
+    size_t base;
+};
+
+// A heap on growable memory, footprint is the committed memory
+template <class HEAP>
+class heap_allocator
+{
+public:
+    heap_allocator() : mem(1ul << 32, 64 << 10), heap(mem) {}
+
+    void *alloc(size_t size) { return heap.alloc(size); }
+    void  free(void *p)      { heap.free(p); }
+
+    size_t footprint() const { return mem.size(); }
+
+private:
+    growable_memory mem;
+    HEAP heap;
+};
+
+struct workload_result
+{
+    double ops_per_sec;
+    double p50;
+    double p99;
+    double p999;
+    size_t peak_footprint;
+    double fragmentation;    // share of the peak footprint not holding live data
+};
+
+// Replays the workload twice on one allocator, first timing every call and
+// tracking the footprint after every alloc, then for throughput. Run it in
+// a fresh process for every allocator, glibc keeps memory of earlier runs
+// in its arena. false if the allocator ran out of memory.
+template <class ALLOC>
+static bool run_workload(const workload &w, workload_result &result)
+{
+    std::vector<void *> ptrs(w.slots);
+    std::vector<float> latency(w.ops.size());
+    std::vector<uint32_t> sizes(w.slots);
+    size_t live {0}, peak_live {0}, peak_footprint {0};
+
+    ALLOC alloc;
+
+    for (size_t i = 0; i < w.ops.size(); i++) {
+        auto &op = w.ops[i];
+        bench_timer timer;
+
+        if (op.size) {
+            ptrs[op.slot] = alloc.alloc(op.size);
+            do_not_optimize(ptrs[op.slot]);
+        } else {
+            alloc.free(ptrs[op.slot]);
+        }
+
+        latency[i] = timer.elapsed_ns();
+
+        if (op.size) {
+            if (not ptrs[op.slot]) {
+                fprintf(stderr, "%s: alloc of %u bytes failed after %zu ops\n", w.name.c_str(), op.size, i);
+
+                for (auto *p : ptrs) {
+                    alloc.free(p);
+                }
+
+                return false;
+            }
+
+            // touch the block like a real user would
+            static_cast<char *>(ptrs[op.slot])[0] = 0;
+            live += op.size;
+            sizes[op.slot] = op.size;
+
+            // only an alloc can grow the footprint
+            peak_footprint = std::max(peak_footprint, alloc.footprint());
+        } else {
+            live -= sizes[op.slot];
+            ptrs[op.slot] = nullptr;
+        }
+
+        peak_live = std::max(peak_live, live);
+    }
+
+    for (auto *&p : ptrs) {
+        alloc.free(p);
+        p = nullptr;
+    }
+
+    bench_timer timer;
+
+    for (auto &op : w.ops) {
+        if (op.size) {
+            ptrs[op.slot] = alloc.alloc(op.size);
+            do_not_optimize(ptrs[op.slot]);
+        } else {
+            alloc.free(ptrs[op.slot]);
+            ptrs[op.slot] = nullptr;
+        }
+    }
+
+    result.ops_per_sec = w.ops.size() / timer.elapsed_ns() * 1e9;
+
+    for (auto *p : ptrs) {
+        alloc.free(p);
+    }
+
+    std::sort(latency.begin(), latency.end());
+
+    auto percentile = [&latency](double p) { return latency[static_cast<size_t>(p * (latency.size() - 1))]; };
+
+    result.p50            = percentile(0.5);
+    result.p99            = percentile(0.99);
+    result.p999           = percentile(0.999);
+    result.peak_footprint = peak_footprint;
+    result.fragmentation  = peak_footprint > peak_live ? 1. - static_cast<double>(peak_live) / peak_footprint : 0.;
+
+    return true;
+}
@@ -0,0 +1,321 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "heap.hpp"
+
+#ifndef HEAP_LINUX
+    #error "arena_heap selects arenas by CPU and is only available with HEAP_LINUX"
+#endif
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How a thread picks the arena it allocates from
+//     * BY_CPU:      the arena of the CPU the thread is running on
+//     * ROUND_ROBIN: every thread gets the next arena on its first call
+enum class arena_select { BY_CPU, ROUND_ROBIN };
+
+// Blocks freed by other threads than the owner of their heap. They are
+// linked through their first word, any thread pushes with a single atomic
+// operation and the owner takes all of them at once. As nodes are never
+// popped one by one, the stack does not suffer from ABA.
+class remote_free_queue
+{
+public:
+    void push(void *p)
+    {
+        auto *n = static_cast<node *>(p);
+
+        n->next = head.load(std::memory_order_relaxed);
+        while (not head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    // the whole stack, follow it with next()
+    void *take_all()
+    {
+        return head.load(std::memory_order_relaxed) ? head.exchange(nullptr, std::memory_order_acquire) : nullptr;
+    }
+
+    static void *next(void *p) { return static_cast<node *>(p)->next; }
+
+private:
+    struct node
+    {
+        node *next;
+    };
+
+    std::atomic<node *> head {nullptr};
+};
+
+// Thread safe heap made of independent arenas, each with a heap on its own
+// slice of the memory and its own lock. Threads allocate from their arena
+// and spill over to the next ones when it is exhausted. free finds the
+// owning arena from the address of the block. Blocks of other arenas are
+// queued without taking their lock and handed back by the arena's next alloc.
+template <class HEAP, class LOCK = std::mutex>
+class arena_heap
+{
+private:
+    struct alignas(64) arena
+    {
+        arena(size_t base, size_t size) : mem(base, size), heap(mem) {}
+
+        // the plain new of C++14 does not honour the alignment
+        static void *operator new(size_t size)
+        {
+            void *p {nullptr};
+
+            if (posix_memalign(&p, alignof(arena), size)) {
+                throw std::bad_alloc();
+            }
+
+            return p;
+        }
+
+        static void operator delete(void *p) { ::free(p); }
+
+        LOCK         lock;
+        fixed_memory mem;
+        HEAP         heap;
+
+        alignas(64) remote_free_queue remote;
+    };
+
+    static constexpr size_t DRAIN_BATCH {64};
+
+    static size_t next_slot()
+    {
+        static std::atomic<size_t> next {0};
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    size_t preferred() const
+    {
+        if (select == arena_select::BY_CPU) {
+            const int cpu {sched_getcpu()};
+
+            if (cpu >= 0) {
+                return cpu % arenas_.size();
+            }
+        }
+
+        thread_local size_t slot {next_slot()};
+        return slot % arenas_.size();
+    }
+
+    arena *owner(void *p) const
+    {
+        const size_t offset {reinterpret_cast<size_t>(p) - base};
+        return offset < slice * arenas_.size() ? arenas_[offset / slice].get() : nullptr;
+    }
+
+    // free the queued remote blocks of a, its lock is held
+    static void drain(arena &a)
+    {
+        void *batch[DRAIN_BATCH];
+        size_t n {0};
+
+        for (void *p = a.remote.take_all(); p;) {
+            void *next = remote_free_queue::next(p);
+
+            batch[n++] = p;
+
+            if (n == DRAIN_BATCH) {
+                a.heap.free_n(batch, n);
+                n = 0;
+            }
+
+            p = next;
+        }
+
+        if (n) {
+            a.heap.free_n(batch, n);
+        }
+    }
+
+    // alloc from the arenas in order starting at first
+    void *alloc_from(size_t first, size_t size)
+    {
+        for (size_t i = 0; i < arenas_.size(); i++) {
+            auto &a = *arenas_[(first + i) % arenas_.size()];
+            std::lock_guard<LOCK> guard(a.lock);
+
+            drain(a);
+
+            void *p = a.heap.alloc(size);
+
+            if (p) {
+                return p;
+            }
+        }
+
+        return nullptr;
+    }
+
+public:
+    // arenas defaults to the number of CPUs, every one gets an equal,
+    // page aligned slice of mem
+    arena_heap(memory &mem, size_t arenas = 0, arena_select select_ = arena_select::BY_CPU)
+        : base(mem.base()), select(select_)
+    {
+        if (not arenas) {
+            arenas = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+        }
+
+        slice = (mem.size() / arenas) & ~(mem.page_size() - 1);
+        ASSERT_HEAP(slice != 0);
+
+        for (size_t i = 0; i < arenas; i++) {
+            arenas_.emplace_back(new arena(base + i * slice, slice));
+        }
+    }
+
+    arena_heap(const arena_heap &) = delete;
+    arena_heap &operator=(const arena_heap &) = delete;
+
+    void *alloc(size_t size) { return alloc_from(preferred(), size); }
+
+    void free(void *p)
+    {
+        auto *a = owner(p);
+
+        if (not a) {
+            return;
+        }
+
+        if (a != arenas_[preferred()].get()) {
+            a->remote.push(p);
+            return;
+        }
+
+        std::lock_guard<LOCK> guard(a->lock);
+        a->heap.free(p);
+    }
+
+    // Resize within the owning arena if possible, otherwise move the data
+    // to any arena with room.
+    void *realloc(void *p, size_t size)
+    {
+        auto *a = owner(p);
+
+        if (not a) {
+            return alloc(size);
+        }
+
+        size_t old_size;
+
+        {
+            std::lock_guard<LOCK> guard(a->lock);
+
+            drain(*a);
+
+            void *resized = a->heap.realloc(p, size);
+
+            if (resized) {
+                return resized;
+            }
+
+            old_size = a->heap.usable_size(p);
+        }
+
+        void *moved = alloc(size);
+
+        if (moved) {
+            memcpy(moved, p, size < old_size ? size : old_size);
+            free(p);
+        }
+
+        return moved;
+    }
+
+    // The size bits of a used block never change while it is allocated.
+    // Merges in the owning arena may update the flags in the same word
+    // meanwhile, the heap reads it atomically, so no lock is taken. 0 for
+    // pointers outside the arenas.
+    size_t usable_size(void *p) const
+    {
+        auto *a = owner(p);
+        return a ? a->heap.usable_size(p) : 0;
+    }
+
+    size_t arenas() const { return arenas_.size(); }
+
+    // index of the arena owning p, arenas() for pointers outside of them
+    size_t arena_of(void *p) const
+    {
+        const size_t offset {reinterpret_cast<size_t>(p) - base};
+        return offset < slice * arenas_.size() ? offset / slice : arenas_.size();
+    }
+
+    size_t free_mem()
+    {
+        size_t bytes {0};
+
+        for (auto &a : arenas_) {
+            std::lock_guard<LOCK> guard(a->lock);
+            drain(*a);
+            bytes += a->heap.free_mem();
+        }
+
+        return bytes;
+    }
+
+    size_t num_blocks()
+    {
+        size_t blocks {0};
+
+        for (auto &a : arenas_) {
+            std::lock_guard<LOCK> guard(a->lock);
+            drain(*a);
+            blocks += a->heap.num_blocks();
+        }
+
+        return blocks;
+    }
+
+    void check_integrity()
+    {
+        for (auto &a : arenas_) {
+            std::lock_guard<LOCK> guard(a->lock);
+            drain(*a);
+            a->heap.check_integrity();
+        }
+    }
+
+private:
+    size_t       base;
+    size_t       slice;
+    arena_select select;
+
+    std::vector<std::unique_ptr<arena>> arenas_;
+};
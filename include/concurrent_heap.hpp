@@ -0,0 +1,345 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "heap.hpp"
+
+#ifndef HEAP_LINUX
+    #error "concurrent_heap relies on thread local storage and is only available with HEAP_LINUX"
+#endif
+
+#include <mutex>
+
+// Hands out small integer ids to threads. The id of an exited thread is
+// given to the next thread that asks for one.
+class heap_thread_id
+{
+public:
+    static constexpr size_t MAX_IDS {1024};
+
+    // Notified when a thread that got an id exits, before the id is handed
+    // out again. Runs on the exiting thread.
+    class listener
+    {
+    public:
+        virtual void thread_exit(size_t id) = 0;
+
+    protected:
+        ~listener() = default;
+
+    private:
+        friend class heap_thread_id;
+
+        listener *next_listener {nullptr};
+    };
+
+    static size_t get()
+    {
+        thread_local holder h;
+        return h.id;
+    }
+
+    static void subscribe(listener *l)
+    {
+        std::lock_guard<std::mutex> guard(lock());
+
+        l->next_listener = listeners();
+        listeners()      = l;
+    }
+
+    static void unsubscribe(listener *l)
+    {
+        std::lock_guard<std::mutex> guard(lock());
+
+        for (listener **link = &listeners(); *link; link = &(*link)->next_listener) {
+            if (*link == l) {
+                *link = l->next_listener;
+                break;
+            }
+        }
+    }
+
+private:
+    struct holder
+    {
+        holder() : id(acquire()) {}
+        ~holder() { release(id); }
+
+        size_t id;
+    };
+
+    static std::mutex &lock()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    static bool *used()
+    {
+        static bool ids[MAX_IDS];
+        return ids;
+    }
+
+    static listener *&listeners()
+    {
+        static listener *head {nullptr};
+        return head;
+    }
+
+    static size_t acquire()
+    {
+        std::lock_guard<std::mutex> guard(lock());
+
+        for (size_t id = 0; id < MAX_IDS; id++) {
+            if (not used()[id]) {
+                used()[id] = true;
+                return id;
+            }
+        }
+
+        return MAX_IDS;
+    }
+
+    static void release(size_t id)
+    {
+        if (id < MAX_IDS) {
+            std::lock_guard<std::mutex> guard(lock());
+
+            for (auto *l = listeners(); l; l = l->next_listener) {
+                l->thread_exit(id);
+            }
+
+            used()[id] = false;
+        }
+    }
+};
+
+// Thread safe front-end for a heap. Every thread owns a cache of recently
+// freed small blocks per size class. Caches are refilled from and flushed to
+// the shared heap in batches, so only one in a batch of alloc or free calls
+// takes the lock. Threads beyond MAX_THREADS and large blocks always go
+// through the lock. The cache of a thread is flushed when it exits.
+template <class HEAP, size_t MAX_THREADS = 64, class LOCK = std::mutex>
+class concurrent_heap : private heap_thread_id::listener
+{
+private:
+    static constexpr size_t granularity() { return HEAP_MIN_ALIGNMENT; }
+    static constexpr size_t num_classes() { return 16; }
+    static constexpr size_t max_cached()  { return num_classes() * granularity(); }
+    static constexpr size_t batch()       { return 16; }
+
+    struct cached_block
+    {
+        cached_block *next;
+    };
+
+    struct bin
+    {
+        cached_block *head  {nullptr};
+        size_t        count {0};
+    };
+
+    struct alignas(64) thread_cache
+    {
+        bin bins[num_classes() + 1];
+    };
+
+    // smallest class whose blocks hold size bytes
+    static size_t alloc_class(size_t size) { return size ? (size + granularity() - 1) / granularity() : 1; }
+
+    // largest class a block of the given usable size can serve
+    static size_t free_class(size_t usable) { return usable / granularity(); }
+
+    bool in_range(void *p) const
+    {
+        return reinterpret_cast<size_t>(p) >= mem.base() and reinterpret_cast<size_t>(p) < mem.end();
+    }
+
+    thread_cache *local()
+    {
+        const size_t id {heap_thread_id::get()};
+        return id < MAX_THREADS ? &caches[id] : nullptr;
+    }
+
+    static void push(bin &b, void *p)
+    {
+        auto *block = static_cast<cached_block *>(p);
+
+        block->next = b.head;
+        b.head      = block;
+        b.count++;
+    }
+
+    static void *pop(bin &b)
+    {
+        auto *block = b.head;
+
+        b.head = block->next;
+        b.count--;
+        return block;
+    }
+
+    void refill(bin &b, size_t cls)
+    {
+        std::lock_guard<LOCK> guard(lock);
+
+        for (size_t i = 0; i < batch(); i++) {
+            void *p = heap.alloc(cls * granularity());
+            if (not p) {
+                break;
+            }
+            push(b, p);
+        }
+    }
+
+    void flush(bin &b, size_t count)
+    {
+        std::lock_guard<LOCK> guard(lock);
+
+        while (b.head and count--) {
+            heap.free(pop(b));
+        }
+    }
+
+    void *alloc_locked(size_t size)
+    {
+        std::lock_guard<LOCK> guard(lock);
+        return heap.alloc(size);
+    }
+
+    void thread_exit(size_t id) override
+    {
+        if (id < MAX_THREADS) {
+            for (auto &b : caches[id].bins) {
+                flush(b, b.count);
+            }
+        }
+    }
+
+public:
+    concurrent_heap(memory &mem) : mem(mem), heap(mem) { heap_thread_id::subscribe(this); }
+    ~concurrent_heap() { heap_thread_id::unsubscribe(this); }
+
+    concurrent_heap(const concurrent_heap &) = delete;
+    concurrent_heap &operator=(const concurrent_heap &) = delete;
+
+    void *alloc(size_t size)
+    {
+        auto *cache = size <= max_cached() ? local() : nullptr;
+
+        if (cache) {
+            const size_t cls {alloc_class(size)};
+            auto &b = cache->bins[cls];
+
+            if (not b.head) {
+                refill(b, cls);
+            }
+
+            if (b.head) {
+                return pop(b);
+            }
+        }
+
+        void *p = alloc_locked(size);
+
+        if (not p and cache) {
+            // the heap might only be exhausted because of our own cache
+            flush();
+            p = alloc_locked(size);
+        }
+
+        return p;
+    }
+
+    void free(void *p)
+    {
+        if (not p) {
+            return;
+        }
+
+        // The size bits of a used block never change, so they are read
+        // without the lock. Merges of the neighbouring blocks update the
+        // flag bits in the same word, the heap accesses it atomically.
+        // Pointers outside the heap range have no header there and are
+        // left to the heap, which frees huge blocks and ignores the rest.
+        const size_t cls {in_range(p) ? free_class(heap.usable_size(p)) : num_classes() + 1};
+        auto *cache = cls <= num_classes() ? local() : nullptr;
+
+        if (cache) {
+            auto &b = cache->bins[cls];
+
+            push(b, p);
+
+            if (b.count > 2 * batch()) {
+                flush(b, batch());
+            }
+
+            return;
+        }
+
+        std::lock_guard<LOCK> guard(lock);
+        heap.free(p);
+    }
+
+    // give all blocks cached by the calling thread back to the heap
+    void flush()
+    {
+        auto *cache = local();
+
+        if (cache) {
+            for (auto &b : cache->bins) {
+                flush(b, b.count);
+            }
+        }
+    }
+
+    void check_integrity()
+    {
+        std::lock_guard<LOCK> guard(lock);
+        heap.check_integrity();
+    }
+
+    // free memory of the shared heap, blocks in thread caches are not included
+    size_t free_mem()
+    {
+        std::lock_guard<LOCK> guard(lock);
+        return heap.free_mem();
+    }
+
+    size_t num_blocks()
+    {
+        std::lock_guard<LOCK> guard(lock);
+        return heap.num_blocks();
+    }
+
+    size_t alignment() const { return heap.alignment(); }
+
+private:
+    memory &mem;
+    LOCK    lock;
+    HEAP    heap;
+
+    thread_cache caches[MAX_THREADS];
+};
@@ -0,0 +1,123 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "heap.hpp"
+
+#ifndef HEAP_LINUX
+    #error "growable_memory relies on mmap and is only available with HEAP_LINUX"
+#endif
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Memory that reserves a range of address space up front and commits it in
+// steps of at least commit_step bytes when the heap runs out. Only the
+// committed part is accessible, the reserved rest costs no memory. Trimmed
+// pages are released with madvise and stay accessible, huge blocks get
+// mappings of their own.
+class growable_memory final : public memory
+{
+private:
+    size_t base_     {0};
+    size_t size_     {0};
+    size_t reserved_ {0};
+    size_t step_;
+
+    size_t round_up(size_t bytes) const
+    {
+        return (bytes + page_size() - 1) & ~(page_size() - 1);
+    }
+
+    bool commit(size_t bytes)
+    {
+        bytes = round_up(bytes);
+
+        if (bytes > reserved_ - size_) {
+            return false;
+        }
+
+        if (mprotect(reinterpret_cast<void *>(end()), bytes, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+
+        // the size is read without the heap's lock, e.g. by concurrent_heap
+        __atomic_store_n(&size_, size_ + bytes, __ATOMIC_RELAXED);
+        return true;
+    }
+
+public:
+    growable_memory(size_t reserve, size_t initial, size_t commit_step = 64 << 10)
+        : step_(commit_step)
+    {
+        reserve = round_up(reserve);
+
+        void *p = mmap(nullptr, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ASSERT_HEAP(p != MAP_FAILED);
+
+        if (p != MAP_FAILED) {
+            base_     = reinterpret_cast<size_t>(p);
+            reserved_ = reserve;
+            commit(initial);
+        }
+    }
+
+    virtual ~growable_memory()
+    {
+        if (reserved_) {
+            munmap(reinterpret_cast<void *>(base_), reserved_);
+        }
+    }
+
+    growable_memory(const growable_memory &) = delete;
+    growable_memory &operator=(const growable_memory &) = delete;
+
+    virtual size_t base() const { return base_; }
+    virtual size_t size() const { return __atomic_load_n(&size_, __ATOMIC_RELAXED); }
+    virtual size_t end()  const { return base_ + size(); }
+
+    size_t reserved() const { return reserved_; }
+
+    virtual size_t page_size() const { return sysconf(_SC_PAGESIZE); }
+
+    virtual bool release(size_t addr, size_t bytes)
+    {
+        return madvise(reinterpret_cast<void *>(addr), bytes, MADV_DONTNEED) == 0;
+    }
+
+    virtual void *map(size_t bytes)
+    {
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p != MAP_FAILED ? p : nullptr;
+    }
+
+    virtual void unmap(void *p, size_t bytes) { munmap(p, bytes); }
+
+    virtual bool grow(size_t bytes)
+    {
+        // commit whole steps but never more than is left
+        return commit(bytes > step_ ? bytes : step_) or commit(bytes);
+    }
+};
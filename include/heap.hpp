@@ -34,6 +34,21 @@ public:
     virtual size_t base() const = 0;
     virtual size_t size() const = 0;
     virtual size_t end()  const = 0;
+
+    // Extend the range at its end by at least bytes, which keeps the end
+    // aligned like the base. Memory that cannot grow returns false.
+    virtual bool grow(size_t) { return false; }
+
+    // Give the page aligned range [addr, addr + bytes) back to the system,
+    // its content is undefined afterwards. Returns false if not supported.
+    virtual bool release(size_t, size_t) { return false; }
+
+    virtual size_t page_size() const { return 4096; }
+
+    // Map bytes of page aligned memory outside the range for a single large
+    // block and unmap it again. Returns nullptr if not supported.
+    virtual void *map(size_t) { return nullptr; }
+    virtual void unmap(void *, size_t) {}
 };
 
 class fixed_memory : public memory
@@ -54,10 +69,207 @@ public:
     virtual size_t end()  const { return base_ + size_; }
 };
 
+// Memory at a range fixed at compile time. The class is final, so a heap
+// that takes it as its MEMORY parameter calls it directly and can fold the
+// bounds into its code.
+template <size_t BASE, size_t SIZE>
+class static_memory final : public memory
+{
+public:
+    size_t base() const override { return BASE; }
+    size_t size() const override { return SIZE; }
+    size_t end()  const override { return BASE + SIZE; }
+};
+
 static constexpr size_t HEAP_MIN_ALIGNMENT = 16;
 
-template<size_t ALIGNMENT = HEAP_MIN_ALIGNMENT>
-class first_fit_heap
+// Snapshot of the running counters of a heap
+struct heap_stats
+{
+    size_t free_bytes      {0};
+    size_t free_blocks     {0};
+    size_t used_bytes      {0};
+    size_t peak_used       {0};
+    size_t allocs          {0};
+    size_t frees           {0};
+    size_t failed          {0};
+    size_t deferred_bytes  {0};
+    size_t deferred_blocks {0};
+};
+
+// Free list roots and counters of a heap with HEAP_MODE_OFFSETS, as offsets
+// from the memory base. Its blocks hold no absolute addresses, so a heap
+// created from them continues on the same memory contents mapped anywhere.
+struct heap_roots
+{
+    size_t     lists[sizeof(size_t) * 8];
+    size_t     list_map;
+    size_t     index;
+    size_t     released;
+    size_t     last_free;
+    heap_stats stats;
+};
+
+#ifdef HEAP_ENABLE_ASSERT
+static constexpr bool HEAP_ASSERTS = true;
+#else
+static constexpr bool HEAP_ASSERTS = false;
+#endif
+
+#ifdef HEAP_DISABLE_STATS
+static constexpr bool HEAP_STATS = false;
+#else
+static constexpr bool HEAP_STATS = true;
+#endif
+
+// Counters updated on every list and heap operation, they compile to
+// nothing without HEAP_STATS.
+template <bool ENABLED = HEAP_STATS>
+class heap_counters
+{
+public:
+    void free_inserted(size_t) {}
+    void free_removed(size_t) {}
+    void free_merged(size_t) {}
+    void allocated(size_t) {}
+    void released(size_t) {}
+    void resized(size_t, size_t) {}
+    void failed() {}
+    void deferred(size_t) {}
+    void undeferred(size_t) {}
+
+    heap_stats get() const { return {}; }
+    void set(const heap_stats &) {}
+};
+
+template <>
+class heap_counters<true>
+{
+public:
+    void free_inserted(size_t bytes)
+    {
+        s.free_bytes += bytes;
+        s.free_blocks++;
+    }
+
+    void free_removed(size_t bytes)
+    {
+        s.free_bytes -= bytes;
+        s.free_blocks--;
+    }
+
+    // two free blocks became one, the header between them is free space now
+    void free_merged(size_t header)
+    {
+        s.free_bytes += header;
+        s.free_blocks--;
+    }
+
+    void allocated(size_t bytes)
+    {
+        s.used_bytes += bytes;
+        s.peak_used   = s.used_bytes > s.peak_used ? s.used_bytes : s.peak_used;
+        s.allocs++;
+    }
+
+    void released(size_t bytes)
+    {
+        s.used_bytes -= bytes;
+        s.frees++;
+    }
+
+    void resized(size_t from, size_t to)
+    {
+        s.used_bytes += to - from;
+        s.peak_used   = s.used_bytes > s.peak_used ? s.used_bytes : s.peak_used;
+    }
+
+    void failed() { s.failed++; }
+
+    // a freed block waits in a quick list or leaves it again
+    void deferred(size_t bytes)
+    {
+        s.deferred_bytes += bytes;
+        s.deferred_blocks++;
+    }
+
+    void undeferred(size_t bytes)
+    {
+        s.deferred_bytes -= bytes;
+        s.deferred_blocks--;
+    }
+
+    heap_stats get() const { return s; }
+    void set(const heap_stats &stats) { s = stats; }
+
+private:
+    heap_stats s;
+};
+
+// Heap modes, can be combined
+//     * HEAP_MODE_BINNED:        keep free blocks in power-of-two size class bins
+//                                instead of a single address ordered list
+//     * HEAP_MODE_DOUBLY_LINKED: free blocks carry a prev pointer, free lists are
+//                                kept in LIFO order and free never walks them
+//     * HEAP_MODE_INDEXED:       additionally index free blocks by (size, address)
+//                                in a tree, alloc takes the smallest fitting block
+//                                in O(log n)
+//     * HEAP_MODE_COMPACT:       one word block headers, data sizes are 8 bytes
+//                                short of a multiple of ALIGNMENT
+//     * HEAP_MODE_DEFERRED:      small blocks are freed onto exact size LIFO quick
+//                                lists without merging and alloc takes them first,
+//                                they are merged when an alloc fails or too many
+//                                bytes wait
+//     * HEAP_MODE_OFFSETS:       free blocks link to each other by their distance
+//                                instead of pointers, the heap can be saved with
+//                                roots() and reattached at another address
+static constexpr unsigned HEAP_MODE_DEFAULT       = 0;
+static constexpr unsigned HEAP_MODE_BINNED        = 1u << 0;
+static constexpr unsigned HEAP_MODE_DOUBLY_LINKED = 1u << 1;
+static constexpr unsigned HEAP_MODE_INDEXED       = 1u << 2;
+static constexpr unsigned HEAP_MODE_COMPACT       = 1u << 3;
+static constexpr unsigned HEAP_MODE_DEFERRED      = 1u << 4;
+static constexpr unsigned HEAP_MODE_OFFSETS       = 1u << 5;
+
+// Fit policies, select which free block alloc takes for a request
+//     * first_fit:   the first block that fits
+//     * next_fit:    the first block that fits, searching from where the last
+//                    search ended (address ordered single list only)
+//     * best_fit:    the smallest block that fits
+//     * good_fit<N>: the smallest block that fits within N blocks after the
+//                    first one that fits
+struct fit_policy
+{
+    static constexpr size_t look_ahead() { return 0; }
+    static constexpr bool   roving()     { return false; }
+
+    // called for every block the search visits
+    static void visit() {}
+};
+
+struct first_fit : fit_policy {};
+
+struct next_fit : fit_policy
+{
+    static constexpr bool roving() { return true; }
+};
+
+struct best_fit : fit_policy
+{
+    static constexpr size_t look_ahead() { return ~0ul; }
+};
+
+template<size_t LOOK_AHEAD>
+struct good_fit : fit_policy
+{
+    static constexpr size_t look_ahead() { return LOOK_AHEAD; }
+};
+
+// Block layout shared by the heap implementations. Every block starts with a
+// header_used, free blocks extend it with their list links and end with a
+// footer holding their size, so neighbours can be found in constant time.
+template<size_t ALIGNMENT, bool DOUBLY_LINKED, bool INDEXED = false, bool COMPACT = false, bool OFFSETS = false>
+class heap_blocks
 {
 private:
     static constexpr size_t min_alignment() { return HEAP_MIN_ALIGNMENT; }
@@ -74,6 +286,87 @@ private:
     template <size_t MIN, size_t SIZE>
     using prepend_alignment_if_greater = align_helper<SIZE, (SIZE > MIN), empty>;
 
+    // A link to another block. With OFFSETS it holds the distance from the
+    // link itself, 0 is no block as a block never links to itself.
+    template <bool, class T>
+    struct HEAP_PACKED link {
+        T   *get() const { return ptr; }
+        void set(T *val) { ptr = val; }
+
+        T *ptr {nullptr};
+    };
+
+    template <class T>
+    struct HEAP_PACKED link<true, T> {
+        T *get() const
+        {
+            return offset ? reinterpret_cast<T *>(reinterpret_cast<size_t>(this) + offset) : nullptr;
+        }
+
+        void set(T *val) { offset = val ? reinterpret_cast<size_t>(val) - reinterpret_cast<size_t>(this) : 0; }
+
+        size_t offset {0};
+    };
+
+    template <bool, class T>
+    struct prev_helper {
+        T   *prev() const { return nullptr; }
+        void prev(T *) {}
+    };
+
+    template <class T>
+    struct HEAP_PACKED prev_helper<true, T> {
+        T   *prev() const { return prev_.get(); }
+        void prev(T *val) { prev_.set(val); }
+
+        link<OFFSETS, T> prev_;
+    };
+
+    // The size and flags word, followed by a canary word unless compact.
+    // Thread safe front ends read the size of a used block without the
+    // heap's lock while its flags change with merges of the neighbours, so
+    // the word is accessed with relaxed atomics.
+    template <bool, class T>
+    struct HEAP_PACKED words_helper {
+        T canary() const { return 0; }
+
+        T    load() const { return __atomic_load_n(reinterpret_cast<const T *>(this), __ATOMIC_RELAXED); }
+        void store(T val) { __atomic_store_n(reinterpret_cast<T *>(this), val, __ATOMIC_RELAXED); }
+
+        T raw;
+    };
+
+    template <class T>
+    struct HEAP_PACKED words_helper<true, T> {
+        T canary() const { return canary_; }
+
+        T    load() const { return __atomic_load_n(reinterpret_cast<const T *>(this), __ATOMIC_RELAXED); }
+        void store(T val) { __atomic_store_n(reinterpret_cast<T *>(this), val, __ATOMIC_RELAXED); }
+
+        T raw;
+        volatile T canary_ {0x1337133713371337ul};
+    };
+
+    template <bool, class T>
+    struct index_helper {
+        T   *left() const  { return nullptr; }
+        T   *right() const { return nullptr; }
+        void left(T *) {}
+        void right(T *) {}
+    };
+
+    template <class T>
+    struct HEAP_PACKED index_helper<true, T> {
+        T   *left() const  { return left_.get(); }
+        T   *right() const { return right_.get(); }
+        void left(T *val)  { left_.set(val); }
+        void right(T *val) { right_.set(val); }
+
+        link<OFFSETS, T> left_;
+        link<OFFSETS, T> right_;
+    };
+
+public:
     class header_free;
     class header_used;
 
@@ -91,60 +384,86 @@ private:
         size_t s;
     };
 
-    class HEAP_PACKED header_used : private prepend_alignment_if_greater<16, ALIGNMENT>
+    // Compact headers are a single word without the alignment padding and
+    // the canary word. With HEAP_ENABLE_ASSERT they keep a short canary in
+    // the top bits of the size instead.
+    class HEAP_PACKED header_used : private prepend_alignment_if_greater<16, COMPACT ? 16 : ALIGNMENT>,
+                                    private words_helper<not COMPACT, size_t>
     {
     private:
         enum {
             PREV_FREE_MASK = ~(1ul << (sizeof(size_t) * 8 - 1)),
             THIS_FREE_MASK = ~(1ul << (sizeof(size_t) * 8 - 2)),
-            SIZE_MASK      = (~PREV_FREE_MASK) | (~THIS_FREE_MASK),
+            TRIMMED_MASK   = ~(1ul << (sizeof(size_t) * 8 - 3)),
+            DEFERRED_MASK  = ~(1ul << (sizeof(size_t) * 8 - 4)),
+            CANARY_BITS    = COMPACT and HEAP_ASSERTS ? 0xffful << 48 : 0,
+            SIZE_MASK      = (~PREV_FREE_MASK) | (~THIS_FREE_MASK) | (~TRIMMED_MASK) | (~DEFERRED_MASK) | CANARY_BITS,
             CANARY_VALUE   = 0x1337133713371337ul,
         };
 
-        size_t raw {0};
-        volatile size_t canary {CANARY_VALUE};
-
     public:
-        header_used(const size_t size_) { size(size_); }
+        header_used(const size_t size_)
+        {
+            this->store(CANARY_VALUE & CANARY_BITS);
+            size(size_);
+        }
 
-        size_t size() const { return raw & ~SIZE_MASK; }
+        size_t size() const { return this->load() & ~SIZE_MASK; }
 
         void size(size_t s)
         {
             ASSERT_HEAP((s & ~SIZE_MASK) == s);
-            raw &= SIZE_MASK;
-            raw |= s & ~SIZE_MASK;
+            this->store((this->load() & SIZE_MASK) | (s & ~SIZE_MASK));
         }
 
-        bool prev_free() const { return raw & ~PREV_FREE_MASK; }
+        bool prev_free() const { return this->load() & ~PREV_FREE_MASK; }
 
         void prev_free(bool val)
         {
-            raw &= PREV_FREE_MASK;
-            raw |= (~PREV_FREE_MASK) * val;
+            this->store((this->load() & PREV_FREE_MASK) | (~PREV_FREE_MASK) * val);
         }
 
-        bool is_free() const { return raw & ~THIS_FREE_MASK; }
+        bool is_free() const { return this->load() & ~THIS_FREE_MASK; }
 
         void is_free(bool val)
         {
-            raw &= THIS_FREE_MASK;
-            raw |= (~THIS_FREE_MASK) * val;
+            this->store((this->load() & THIS_FREE_MASK) | (~THIS_FREE_MASK) * val);
+        }
+
+        // the pages inside this free block were given back to the system
+        bool trimmed() const { return this->load() & ~TRIMMED_MASK; }
+
+        void trimmed(bool val)
+        {
+            this->store((this->load() & TRIMMED_MASK) | (~TRIMMED_MASK) * val);
+        }
+
+        // freed, but waiting in a quick list instead of a free list
+        bool deferred() const { return this->load() & ~DEFERRED_MASK; }
+
+        void deferred(bool val)
+        {
+            this->store((this->load() & DEFERRED_MASK) | (~DEFERRED_MASK) * val);
         }
 
-        bool canary_alive() { return canary == CANARY_VALUE; }
+        bool canary_alive()
+        {
+            return COMPACT ? (this->load() & CANARY_BITS) == (CANARY_VALUE & CANARY_BITS) : this->canary() == CANARY_VALUE;
+        }
 
-        header_used *following_block(const memory &mem)
+        template <class MEMORY>
+        header_used *following_block(const MEMORY &mem)
         {
             auto *following = reinterpret_cast<header_used *>(reinterpret_cast<char *>(this) + sizeof(header_used) + size());
-            if (reinterpret_cast<size_t>(following) >= mem.end()) {
+            if (reinterpret_cast<size_t>(following) + trail() >= mem.end()) {
                 return nullptr;
             }
 
             return following;
         }
 
-        header_used *preceding_block([[maybe_unused]] const memory& mem)
+        template <class MEMORY>
+        header_used *preceding_block([[maybe_unused]] const MEMORY &mem)
         {
             if (not prev_free()) {
                 return nullptr;
@@ -160,7 +479,9 @@ private:
         void *data_ptr() { return this+1; }
     };
 
-    class HEAP_PACKED header_free : public header_used
+    class HEAP_PACKED header_free : public header_used,
+                                    public prev_helper<DOUBLY_LINKED or INDEXED, header_free>,
+                                    public index_helper<INDEXED, header_free>
     {
     public:
         header_free(const size_t size) : header_used(size)
@@ -169,8 +490,8 @@ private:
             this->is_free(true);
         }
 
-        header_free *next() const { return next_; }
-        void         next(header_free *val) { next_ = val; }
+        header_free *next() const { return next_.get(); }
+        void         next(header_free *val) { next_.set(val); }
 
         footer *get_footer()
         {
@@ -182,21 +503,156 @@ private:
             get_footer()->size(this->size());
         }
 
-        header_free *next_ {nullptr};
+        link<OFFSETS, header_free> next_;
     };
 
+    // Data is aligned to ALIGNMENT. Compact headers are smaller than that,
+    // the first block then starts lead() bytes into the memory and the last
+    // one ends trail() bytes before its end.
+    static constexpr size_t lead()  { return ALIGNMENT - sizeof(header_used); }
+    static constexpr size_t trail() { return sizeof(header_used) % ALIGNMENT; }
+};
+
+// MEMORY is the type of memory the heap is created on. With a final class
+// like static_memory instead of the memory base class no call into it is
+// virtual.
+template<size_t ALIGNMENT = HEAP_MIN_ALIGNMENT, unsigned MODE = HEAP_MODE_DEFAULT, class FIT = first_fit, class MEMORY = memory>
+class first_fit_heap
+{
+    static_assert(not (FIT::roving() and MODE != HEAP_MODE_DEFAULT), "next fit needs a single address ordered free list");
+    static_assert(not ((MODE & HEAP_MODE_INDEXED) and (MODE & HEAP_MODE_BINNED)), "the index replaces the bins");
+
+private:
+    static constexpr size_t min_alignment() { return HEAP_MIN_ALIGNMENT; }
+
+    static constexpr bool binned()        { return MODE & HEAP_MODE_BINNED; }
+    static constexpr bool doubly_linked() { return MODE & HEAP_MODE_DOUBLY_LINKED; }
+    static constexpr bool indexed()       { return MODE & HEAP_MODE_INDEXED; }
+    static constexpr bool compact()       { return MODE & HEAP_MODE_COMPACT; }
+    static constexpr bool deferred()      { return MODE & HEAP_MODE_DEFERRED; }
+    static constexpr bool offsets()       { return MODE & HEAP_MODE_OFFSETS; }
+
+    using blocks      = heap_blocks<ALIGNMENT, doubly_linked(), indexed(), compact(), offsets()>;
+    using footer      = typename blocks::footer;
+    using header_used = typename blocks::header_used;
+    using header_free = typename blocks::header_free;
+
     class free_list_container
     {
     public:
-        free_list_container(memory &mem_, header_free *root) : mem(mem_), list(root)
+        free_list_container(MEMORY &mem_, header_free *root) : mem(mem_)
         {
             ASSERT_HEAP(ALIGNMENT != 0);
             ASSERT_HEAP(ALIGNMENT >= min_alignment());
             ASSERT_HEAP((ALIGNMENT & (ALIGNMENT - 1)) == 0);
-            ASSERT_HEAP(sizeof(header_used) == ALIGNMENT);
+            ASSERT_HEAP(compact() or sizeof(header_used) == ALIGNMENT);
             ASSERT_HEAP(mem.size() != 0);
             ASSERT_HEAP((mem.base() & (ALIGNMENT - 1)) == 0);
             ASSERT_HEAP((mem.base() + mem.size()) > mem.base());
+
+            for (auto &list : lists) {
+                list = nullptr;
+            }
+
+            for (auto &list : quick) {
+                list = nullptr;
+            }
+
+            insert_after(root, position_for(root));
+        }
+
+        // continue a heap with HEAP_MODE_OFFSETS from its saved roots
+        free_list_container(MEMORY &mem_, const heap_roots &roots) : mem(mem_)
+        {
+            for (auto &list : quick) {
+                list = nullptr;
+            }
+
+            restore(roots);
+        }
+
+        void restore(const heap_roots &roots)
+        {
+            ASSERT_HEAP(not deferred_bytes_);
+
+            for (size_t idx = 0; idx < num_lists(); idx++) {
+                lists[idx] = block_at(roots.lists[idx]);
+            }
+
+            list_map   = roots.list_map;
+            index      = block_at(roots.index);
+            released   = roots.released;
+            last_free_ = roots.last_free;
+            counters.set(roots.stats);
+        }
+
+        heap_roots roots() const
+        {
+            heap_roots roots {};
+
+            ASSERT_HEAP(not deferred_bytes_);
+
+            for (size_t idx = 0; idx < size_bits(); idx++) {
+                roots.lists[idx] = idx < num_lists() ? offset_of(lists[idx]) : NO_BLOCK;
+            }
+
+            roots.list_map  = list_map;
+            roots.index     = offset_of(index);
+            roots.released  = released;
+            roots.last_free = last_free_;
+            roots.stats     = counters.get();
+            return roots;
+        }
+
+        // Check the free lists against the free blocks and bytes found by a
+        // walk over the memory. Links are checked before they are followed,
+        // so damaged lists end the check instead of the process.
+        bool verify(size_t blocks, size_t bytes) const
+        {
+            size_t cnt {0}, size {0};
+
+            for (size_t idx = 0; idx < num_lists(); idx++) {
+                if ((lists[idx] != nullptr) != ((list_map >> idx) & 1)) {
+                    return false;
+                }
+
+                for (header_free *elem {lists[idx]}, *prev {nullptr}; elem; prev = elem, elem = elem->next()) {
+                    if (cnt++ == blocks or not plausible(elem) or not elem->is_free() or list_index(elem->size()) != idx) {
+                        return false;
+                    }
+
+                    if ((doubly_linked() or indexed()) and elem->prev() != prev) {
+                        return false;
+                    }
+
+                    if (not doubly_linked() and elem < prev) {
+                        return false;
+                    }
+
+                    size += elem->size();
+                }
+            }
+
+            size_t budget {blocks};
+
+            return cnt == blocks and size == bytes and (not indexed() or (verify_tree(index, budget) and budget == 0));
+        }
+
+        // the quick lists hold exactly the blocks marked deferred
+        bool verify_deferred(size_t blocks) const
+        {
+            size_t cnt {0};
+
+            for (size_t idx = 0; idx < quick_lists(); idx++) {
+                for (auto *block = quick[idx]; block; block = *static_cast<header_used **>(block->data_ptr())) {
+                    if (cnt++ == blocks or not plausible(static_cast<header_free *>(block)) or not block->deferred() or
+                        quick_index(block->size()) != idx) {
+                        return false;
+                    }
+                }
+            }
+
+            return cnt == blocks;
         }
 
         class iterator
@@ -221,13 +677,48 @@ private:
             header_free *block;
         };
 
-        iterator begin() const { return iterator(list); }
-        iterator end()   const { return iterator(); }
+        class chain
+        {
+        public:
+            chain(header_free *head_, header_free *stop_ = nullptr) : head(head_), stop(stop_) {}
+
+            iterator begin() const { return iterator(head); }
+            iterator end()   const { return iterator(stop); }
+
+        private:
+            header_free *head;
+            header_free *stop;
+        };
+
+        iterator end() const { return iterator(); }
+
+        template <class FN>
+        void for_each(FN fn) const
+        {
+            for (auto *list : lists) {
+                for (auto elem : chain(list)) {
+                    fn(elem);
+                }
+            }
+        }
 
     private:
+        static constexpr size_t size_bits() { return sizeof(size_t) * 8; }
+        static constexpr size_t num_lists() { return binned() ? size_bits() : 1; }
+
+        static size_t list_index(size_t size)
+        {
+            return binned() ? size_bits() - 1 - __builtin_clzl(size) : 0;
+        }
+
         iterator position_for(header_free *val)
         {
-            for (auto elem : *this) {
+            if (doubly_linked()) {
+                // lists are not address ordered, put the block at the head
+                return end();
+            }
+
+            for (auto elem : chain(lists[list_index(val->size())])) {
                 if (not elem->next() or (elem->next() > val)) {
                     return elem < val ? iterator(elem) : iterator();
                 }
@@ -236,24 +727,42 @@ private:
             return end();
         }
 
+        // set the prev_free flag of the block following val, which is kept
+        // in last_free_ for the end of the memory
+        void following_prev_free(header_used *val, bool free_)
+        {
+            auto *following = val->following_block(mem);
+
+            if (following) {
+                following->prev_free(free_);
+            } else {
+                last_free_ = free_;
+            }
+        }
+
         iterator insert_after(header_free *val, iterator other)
         {
             if (not val) {
                 return {};
             }
 
-            ASSERT_HEAP(val > *other);
+            ASSERT_HEAP(doubly_linked() or val > *other);
 
             if (other == end()) {
                 // insert at list head
-                val->next(list);
+                const size_t idx {list_index(val->size())};
+
+                val->next(lists[idx]);
+                val->prev(nullptr);
                 val->is_free(true);
                 val->update_footer();
-                list = val;
+                lists[idx] = val;
+                list_map |= 1ul << idx;
             } else {
                 // insert block into chain
                 auto *tmp = (*other)->next();
                 val->next(tmp);
+                val->prev(*other);
                 val->is_free(true);
                 val->update_footer();
 
@@ -261,13 +770,17 @@ private:
                 (*other)->next(val);
             }
 
+            if (val->next()) {
+                val->next()->prev(val);
+            }
+
+            index_insert(val);
+            counters.free_inserted(val->size());
+
             // update meta data of surrounding blocks
-            auto       *following = val->following_block(mem);
             const auto *preceding = val->preceding_block(mem);
 
-            if (following) {
-                following->prev_free(true);
-            }
+            following_prev_free(val, true);
 
             if (preceding and preceding->is_free()) {
                 val->prev_free(true);
@@ -276,15 +789,75 @@ private:
             return {val};
         }
 
+        void remove_after(header_free *val, iterator prev)
+        {
+            if (FIT::roving() and val == rover) {
+                rover = *prev;
+            }
+
+            index_remove(val);
+            untrim(val);
+            counters.free_removed(val->size());
+
+            if (val->next()) {
+                val->next()->prev(*prev);
+            }
+
+            if (*prev) {
+                (*prev)->next(val->next());
+                return;
+            }
+
+            const size_t idx {list_index(val->size())};
+
+            ASSERT_HEAP(lists[idx] == val);
+            lists[idx] = val->next();
+
+            if (not lists[idx]) {
+                list_map &= ~(1ul << idx);
+            }
+        }
+
+        void remove(header_free *val)
+        {
+            if (doubly_linked() or indexed()) {
+                remove_after(val, {val->prev()});
+                return;
+            }
+
+            iterator prev;
+
+            for (auto elem : chain(lists[list_index(val->size())])) {
+                if (elem == val) {
+                    break;
+                }
+                prev = iterator(elem);
+            }
+
+            remove_after(val, prev);
+        }
+
         iterator try_merge_back(iterator it)
         {
             auto *following = (*it)->following_block(mem);
 
             if (following and following->is_free()) {
                 auto *following_free = static_cast<header_free*>(following);
+                if (FIT::roving() and following_free == rover) {
+                    rover = *it;
+                }
+                index_remove(following_free);
+                index_remove(*it);
+                untrim(following_free);
+                untrim(*it);
                 (*it)->next(following_free->next());
+                if (following_free->next()) {
+                    following_free->next()->prev(*it);
+                }
                 (*it)->size((*it)->size() + following_free->size() + sizeof(header_used));
                 (*it)->update_footer();
+                index_insert(*it);
+                counters.free_merged(sizeof(header_used));
             }
 
             return it;
@@ -305,59 +878,312 @@ private:
             return try_merge_back({preceding});
         }
 
-        static constexpr size_t min_block_size() { return sizeof(header_free) - sizeof(header_used) + sizeof(footer); }
+        header_free *coalesce(header_free *val)
+        {
+            // neighbours are found through the boundary tags, they only
+            // have to be taken out of their own lists before growing val
+            auto *following = val->following_block(mem);
 
-        size_t align(size_t size) const
+            if (following and following->is_free()) {
+                remove(static_cast<header_free *>(following));
+                val->size(val->size() + following->size() + sizeof(header_used));
+            }
+
+            if (val->prev_free()) {
+                auto *preceding = static_cast<header_free *>(val->preceding_block(mem));
+
+                ASSERT_HEAP(preceding->is_free());
+                remove(preceding);
+                preceding->size(preceding->size() + val->size() + sizeof(header_used));
+                val = preceding;
+            }
+
+            return val;
+        }
+
+        // The index is a treap ordered by (size, address), the heap order
+        // comes from a hash of the address so no priority has to be stored.
+        static size_t priority(const header_free *val)
         {
-            size_t real_size {(size + ALIGNMENT - 1) & ~(ALIGNMENT - 1)};
-            return HEAP_MAX(min_block_size(), real_size);
+            return (reinterpret_cast<size_t>(val) / ALIGNMENT) * 0x9e3779b97f4a7c15ul;
         }
 
-        bool fits(header_free &block, size_t size) const
+        static bool less(const header_free *a, const header_free *b)
         {
-            ASSERT_HEAP(size >= min_block_size());
-            return block.size() >= size;
+            return a->size() < b->size() or (a->size() == b->size() and a < b);
         }
 
-        iterator first_free(size_t size, iterator &before) const
+        static void split(header_free *tree, const header_free *key, header_free *&left, header_free *&right)
         {
-            iterator before_ = end();
+            if (not tree) {
+                left = right = nullptr;
+            } else if (less(tree, key)) {
+                header_free *tmp;
+                split(tree->right(), key, tmp, right);
+                tree->right(tmp);
+                left = tree;
+            } else {
+                header_free *tmp;
+                split(tree->left(), key, left, tmp);
+                tree->left(tmp);
+                right = tree;
+            }
+        }
 
-            for (auto elem : *this) {
-                if (fits(*elem, size)) {
-                    before = before_;
-                    return {elem};
-                }
-                before_ = iterator(elem);
+        static header_free *join(header_free *left, header_free *right)
+        {
+            if (not left or not right) {
+                return left ? left : right;
+            }
+
+            if (priority(left) > priority(right)) {
+                left->right(join(left->right(), right));
+                return left;
             }
 
-            return {};
+            right->left(join(left, right->left()));
+            return right;
         }
 
-    public:
-        iterator insert(header_free *val)
+        static header_free *tree_insert(header_free *tree, header_free *val)
         {
-            auto pos  = position_for(val);
-            auto elem = insert_after(val, pos);
-            return try_merge_front(try_merge_back(elem));
-        }
+            if (not tree or priority(val) > priority(tree)) {
+                header_free *left, *right;
+                split(tree, val, left, right);
+                val->left(left);
+                val->right(right);
+                return val;
+            }
 
+            if (less(val, tree)) {
+                tree->left(tree_insert(tree->left(), val));
+            } else {
+                tree->right(tree_insert(tree->right(), val));
+            }
 
-        header_used *alloc(size_t size)
+            return tree;
+        }
+
+        static header_free *tree_remove(header_free *tree, header_free *val)
         {
-            size = HEAP_MAX(size, ALIGNMENT);
-            size = align(size);
+            ASSERT_HEAP(tree);
 
-            iterator prev;
-            auto it = first_free(size, prev);
+            if (tree == val) {
+                return join(tree->left(), tree->right());
+            }
 
-            if (it == end()) {
-                return nullptr;
+            if (less(val, tree)) {
+                tree->left(tree_remove(tree->left(), val));
+            } else {
+                tree->right(tree_remove(tree->right(), val));
+            }
+
+            return tree;
+        }
+
+        void index_insert(header_free *val)
+        {
+            if (indexed()) {
+                index = tree_insert(index, val);
+            }
+        }
+
+        void index_remove(header_free *val)
+        {
+            if (indexed()) {
+                index = tree_remove(index, val);
+            }
+        }
+
+        // pages between the list links and the footer of a free block
+        size_t trimmable(header_free *val, size_t &start) const
+        {
+            const size_t page {mem.page_size()};
+            const size_t stop {reinterpret_cast<size_t>(val->get_footer()) & ~(page - 1)};
+
+            start = (reinterpret_cast<size_t>(val) + sizeof(header_free) + page - 1) & ~(page - 1);
+            return stop > start ? stop - start : 0;
+        }
+
+        // Blocks leaving the free list or changing their size are counted as
+        // resident again, their pages come back when they are touched.
+        void untrim(header_free *val)
+        {
+            if (val->trimmed()) {
+                size_t start;
+                released -= trimmable(val, start);
+                val->trimmed(false);
+            }
+        }
+
+        // smallest block of at least size bytes
+        header_free *index_lower_bound(size_t size) const
+        {
+            header_free *found {nullptr};
+
+            for (auto *tree = index; tree;) {
+                FIT::visit();
+
+                if (tree->size() >= size) {
+                    found = tree;
+                    tree  = tree->left();
+                } else {
+                    tree = tree->right();
+                }
+            }
+
+            return found;
+        }
+
+        static constexpr size_t min_block_size() { return sizeof(header_free) - sizeof(header_used) + sizeof(footer); }
+
+        // block sizes keep the following header in front of aligned data
+        size_t align(size_t size) const
+        {
+            size = HEAP_MAX(min_block_size(), size);
+            return ((size + sizeof(header_used) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) - sizeof(header_used);
+        }
+
+        bool fits(header_free &block, size_t size) const
+        {
+            ASSERT_HEAP(size >= min_block_size());
+            return block.size() >= size;
+        }
+
+        // search list for a block according to the fit policy, list_before
+        // is the element in front of the head of list
+        iterator search(const chain &list, iterator list_before, size_t size, iterator &before) const
+        {
+            iterator before_ = list_before;
+            iterator found;
+            size_t   look_ahead {FIT::look_ahead()};
+
+            for (auto elem : list) {
+                FIT::visit();
+
+                if (fits(*elem, size) and (not *found or elem->size() < (*found)->size())) {
+                    before = before_;
+                    found  = iterator(elem);
+
+                    if (elem->size() == size) {
+                        break;
+                    }
+                }
+
+                if (*found and look_ahead-- == 0) {
+                    break;
+                }
+
+                before_ = iterator(elem);
+            }
+
+            return found;
+        }
+
+        iterator find_free(size_t size, iterator &before) const
+        {
+            if (indexed()) {
+                auto *found = index_lower_bound(size);
+
+                before = iterator(found ? found->prev() : nullptr);
+                return {found};
+            }
+
+            if (FIT::roving()) {
+                // resume at the first block behind the last allocated one, blocks
+                // freed since then may sit between it and the rover
+                iterator     start_before {rover};
+                header_free *start {rover ? rover->next() : lists[0]};
+
+                while (start and reinterpret_cast<size_t>(start) < resume) {
+                    start_before = iterator(start);
+                    start        = start->next();
+                }
+
+                auto it = search(chain(start), start_before, size, before);
+
+                if (it == end() and start != lists[0]) {
+                    // wrap around once
+                    it = search(chain(lists[0], start), {}, size, before);
+                }
+
+                return it;
+            }
+
+            if (not binned()) {
+                return search(chain(lists[0]), {}, size, before);
+            }
+
+            // every block in a bin above the first one that can contain
+            // smaller blocks fits, so its head can be taken right away
+            const size_t idx {list_index(size)};
+            const size_t all_fit {(size & (size - 1)) ? idx + 1 : idx};
+            const size_t candidates {all_fit < size_bits() ? list_map & ~((1ul << all_fit) - 1) : 0};
+
+            // policies looking for smaller blocks try the own bin first
+            if (FIT::look_ahead() != 0) {
+                auto it = search(chain(lists[idx]), {}, size, before);
+
+                if (it != end() or not candidates) {
+                    return it;
+                }
+            }
+
+            if (candidates) {
+                return search(chain(lists[__builtin_ctzl(candidates)]), {}, size, before);
+            }
+
+            return search(chain(lists[idx]), {}, size, before);
+        }
+
+    public:
+        iterator insert(header_free *val)
+        {
+            if (binned() or doubly_linked()) {
+                val = coalesce(val);
+                return insert_after(val, position_for(val));
+            }
+
+            auto pos  = position_for(val);
+            auto elem = insert_after(val, pos);
+            return try_merge_front(try_merge_back(elem));
+        }
+
+
+        header_used *alloc(size_t size)
+        {
+            // aligning a larger request would wrap around
+            if (size > mem.size()) {
+                return nullptr;
+            }
+
+            size = HEAP_MAX(size, ALIGNMENT);
+            size = align(size);
+
+            if (deferred()) {
+                auto *block = quick_pop(size);
+
+                if (block) {
+                    return block;
+                }
+            }
+
+            iterator prev;
+            auto it = find_free(size, prev);
+
+            if (it == end() and consolidate()) {
+                it = find_free(size, prev);
+            }
+
+            if (it == end()) {
+                return nullptr;
             }
 
             auto  &block          = **it;
             size_t size_remaining = block.size() - size;
 
+            remove_after(&block, prev);
+
             if (size_remaining < (sizeof(header_free) + sizeof(footer))) {
                 // remaining size cannot hold another block, use entire space
                 size += size_remaining;
@@ -366,96 +1192,1034 @@ private:
                 block.size(size);
                 block.update_footer();
                 auto *new_block = new (block.following_block(mem)) header_free(size_remaining - sizeof(header_used));
-                new_block->next(block.next());
-                new_block->prev_free(true);
-                block.next(new_block);
+
+                // the remainder takes over the position of the block in a
+                // single list, bins might need a different one
+                insert_after(new_block, binned() ? position_for(new_block) : prev);
             }
 
-            if (*prev) {
-                (*prev)->next(block.next());
+            following_prev_free(&block, false);
+            block.is_free(false);
+
+            if (FIT::roving()) {
+                rover  = *prev;
+                resume = reinterpret_cast<size_t>(block.data_ptr()) + block.size();
+            }
+
+            return &block;
+        }
+
+        // bytes a block for a request of size takes up including its header
+        size_t block_bytes(size_t size) const
+        {
+            size = HEAP_MAX(size, ALIGNMENT);
+            return align(size) + sizeof(header_used);
+        }
+
+        // Cut up to count blocks of size out of free blocks, preferring one
+        // that holds the whole rest of the batch. Each free block is split in
+        // a single pass and leaves at most one remainder behind. Returns the
+        // number of blocks stored in out.
+        size_t alloc_n(size_t size, size_t count, void **out)
+        {
+            if (size > mem.size()) {
+                return 0;
+            }
+
+            const size_t stride {block_bytes(size)};
+            size_t n {0};
+
+            size = stride - sizeof(header_used);
+
+            while (n < count) {
+                const size_t rest {count - n};
+
+                iterator prev;
+                auto it = rest < (~0ul >> 2) / stride ? find_free(rest * stride - sizeof(header_used), prev) : end();
+
+                if (it == end()) {
+                    it = find_free(size, prev);
+                }
+
+                if (it == end() and consolidate()) {
+                    continue;
+                }
+
+                if (it == end()) {
+                    break;
+                }
+
+                auto *block = *it;
+                const size_t bytes {block->size() + sizeof(header_used)};
+                const size_t num {bytes / stride < rest ? bytes / stride : rest};
+                size_t remaining {bytes - num * stride};
+
+                remove_after(block, prev);
+
+                block->size(size);
+                block->is_free(false);
+
+                header_used *last {block};
+                out[n++] = block->data_ptr();
+
+                for (size_t i = 1; i < num; i++) {
+                    last     = new (reinterpret_cast<char *>(last) + stride) header_used(size);
+                    out[n++] = last->data_ptr();
+                }
+
+                if (remaining < min_split()) {
+                    // remaining size cannot hold another block, the last one takes it
+                    last->size(size + remaining);
+                    remaining = 0;
+
+                    following_prev_free(last, false);
+                } else {
+                    auto *new_block = new (reinterpret_cast<char *>(last) + stride) header_free(remaining - sizeof(header_used));
+                    insert_after(new_block, binned() ? position_for(new_block) : prev);
+                }
+
+                if (FIT::roving()) {
+                    rover  = *prev;
+                    resume = reinterpret_cast<size_t>(last->data_ptr()) + last->size();
+                }
+            }
+
+            return n;
+        }
+
+        // Put the blocks at ptrs, sorted by address, back into the free lists.
+        // A single address ordered list is merged with them in one sweep.
+        // merged is called once for every free block the sweep leaves behind.
+        template <class FN>
+        void insert_n(void **ptrs, size_t count, FN merged)
+        {
+            auto header_of = [](void *p) { return reinterpret_cast<header_free *>(reinterpret_cast<char *>(p) - sizeof(header_used)); };
+
+            if (binned() or doubly_linked()) {
+                for (size_t i = 0; i < count; i++) {
+                    merged(*insert(header_of(ptrs[i])));
+                }
+                return;
+            }
+
+            iterator     pos;
+            header_free *last {nullptr};
+
+            for (size_t i = 0; i < count; i++) {
+                auto *val  = header_of(ptrs[i]);
+                auto *next = *pos ? (*pos)->next() : lists[0];
+
+                ASSERT_HEAP(i == 0 or ptrs[i - 1] < ptrs[i]);
+
+                while (next and next < val) {
+                    pos  = iterator(next);
+                    next = next->next();
+                }
+
+                pos = try_merge_front(try_merge_back(insert_after(val, pos)));
+
+                // blocks in front of pos cannot grow anymore
+                if (last and last != *pos) {
+                    merged(last);
+                }
+
+                last = *pos;
+            }
+
+            if (last) {
+                merged(last);
+            }
+        }
+
+        // Deferred mode: push a small freed block onto the quick list of its
+        // size. It stays a used block to its neighbours and is not merged.
+        // false if the block is too large for the quick lists.
+        bool defer(header_used *block)
+        {
+            const size_t idx {quick_index(block->size())};
+
+            if (not deferred() or idx >= quick_lists()) {
+                return false;
+            }
+
+            *static_cast<header_used **>(block->data_ptr()) = quick[idx];
+            quick[idx] = block;
+
+            block->deferred(true);
+            deferred_bytes_ += block->size();
+            counters.deferred(block->size());
+            return true;
+        }
+
+        // Move all blocks of the quick lists into the free lists, merged is
+        // called with the free block each one ended up in. false if there
+        // were none.
+        template <class FN>
+        bool consolidate(FN merged)
+        {
+            if (not deferred_bytes_) {
+                return false;
+            }
+
+            for (auto &list : quick) {
+                while (list) {
+                    auto *block = list;
+
+                    list = *static_cast<header_used **>(block->data_ptr());
+                    block->deferred(false);
+                    counters.undeferred(block->size());
+                    merged(*insert(static_cast<header_free *>(block)));
+                }
+            }
+
+            deferred_bytes_ = 0;
+            return true;
+        }
+
+        bool consolidate() { return consolidate([](header_free *) {}); }
+
+        size_t deferred_bytes() const { return deferred_bytes_; }
+
+        // the last block of the memory is free
+        bool last_free() const { return last_free_; }
+
+        template <class FN>
+        void for_each_deferred(FN fn) const
+        {
+            for (size_t idx = 0; idx < quick_lists(); idx++) {
+                for (auto *block = quick[idx]; block; block = *static_cast<header_used **>(block->data_ptr())) {
+                    fn(block, idx);
+                }
+            }
+        }
+
+        // quick list of the blocks with size bytes of data
+        static size_t quick_index(size_t size) { return (size + sizeof(header_used)) / ALIGNMENT - 1; }
+
+        static constexpr size_t quick_lists() { return deferred() ? 16 : 0; }
+
+        size_t trim(header_free *val)
+        {
+            size_t start;
+            const size_t bytes {trimmable(val, start)};
+
+            if (val->trimmed() or not bytes or not mem.release(start, bytes)) {
+                return 0;
+            }
+
+            val->trimmed(true);
+            released += bytes;
+            return bytes;
+        }
+
+        size_t trim()
+        {
+            size_t bytes {0};
+
+            for_each([&](header_free *elem) { bytes += trim(elem); });
+
+            return bytes;
+        }
+
+        size_t released_mem() const { return released; }
+
+        // The index keeps the largest block rightmost and a block in the
+        // highest bin is larger than any in lower bins, otherwise walk.
+        size_t largest_free() const
+        {
+            size_t largest {0};
+
+            if (indexed()) {
+                for (auto *tree = index; tree; tree = tree->right()) {
+                    largest = tree->size();
+                }
+            } else if (binned()) {
+                if (list_map) {
+                    for (auto elem : chain(lists[size_bits() - 1 - __builtin_clzl(list_map)])) {
+                        largest = elem->size() > largest ? elem->size() : largest;
+                    }
+                }
             } else {
-                list = block.next();
+                for_each([&largest](header_free *elem) { largest = elem->size() > largest ? elem->size() : largest; });
             }
 
-            auto *following = block.following_block(mem);
-            if (following) {
-                following->prev_free(false);
+            return largest;
+        }
+
+        // Grow the memory to fit a block of size bytes. The new tail is added
+        // to a free block ending at the old end or becomes a block of its own.
+        bool extend(size_t size)
+        {
+            const size_t old_end {mem.end() - blocks::trail()};
+
+            if (size > (~0ul >> 1) or not mem.grow(size + sizeof(header_used) + min_split())) {
+                return false;
             }
 
-            block.is_free(false);
-            return &block;
+            ASSERT_HEAP(((mem.end() - blocks::trail() - old_end) & (ALIGNMENT - 1)) == 0);
+
+            if (last_free_) {
+                // the boundary tag of the free block ending at the old end
+                auto *last = reinterpret_cast<footer *>(old_end - sizeof(footer))->header();
+
+                ASSERT_HEAP(last->is_free() and reinterpret_cast<size_t>(last->data_ptr()) + last->size() == old_end);
+                remove(last);
+                last->size(last->size() + mem.end() - blocks::trail() - old_end);
+                insert(last);
+            } else {
+                insert(new (reinterpret_cast<void *>(old_end)) header_free(mem.end() - blocks::trail() - old_end - sizeof(header_used)));
+            }
+
+            return true;
+        }
+
+        // smallest region a block of its own can be split into
+        static constexpr size_t min_split() { return sizeof(header_free) + sizeof(footer); }
+
+        // First data address in block aligned to alignment. Slack in front of
+        // it has to be large enough to become a free block of its own.
+        static size_t aligned_data(header_free *block, size_t alignment)
+        {
+            const size_t data {reinterpret_cast<size_t>(block->data_ptr())};
+            size_t aligned {(data + alignment - 1) & ~(alignment - 1)};
+
+            while (aligned != data and aligned - data < min_split()) {
+                aligned += alignment;
+            }
+
+            return aligned;
+        }
+
+        static bool fits_aligned(header_free *block, size_t size, size_t alignment)
+        {
+            return aligned_data(block, alignment) + size <= reinterpret_cast<size_t>(block->data_ptr()) + block->size();
+        }
+
+        header_used *alloc_aligned(size_t size, size_t alignment)
+        {
+            ASSERT_HEAP((alignment & (alignment - 1)) == 0 and alignment > ALIGNMENT);
+
+            if (size > (~0ul >> 2) or alignment > (~0ul >> 2)) {
+                return nullptr;
+            }
+
+            size = HEAP_MAX(size, ALIGNMENT);
+            size = align(size);
+
+            // any block this large fits, the policy picks one of them
+            const size_t padded {size + alignment + min_split()};
+
+            iterator prev;
+            header_free *block {*find_free(padded, prev)};
+
+            if (not block and consolidate()) {
+                block = *find_free(padded, prev);
+            }
+
+            if (not block and extend(padded)) {
+                block = *find_free(padded, prev);
+            }
+
+            if (block) {
+                remove_after(block, prev);
+            } else {
+                // smaller blocks might still have an aligned address at the right spot
+                for_each([&](header_free *elem) {
+                    if (not block and fits_aligned(elem, size, alignment)) {
+                        block = elem;
+                    }
+                });
+
+                if (not block) {
+                    return nullptr;
+                }
+
+                remove(block);
+            }
+
+            const size_t data {aligned_data(block, alignment)};
+            header_used *used {block};
+
+            if (data != reinterpret_cast<size_t>(block->data_ptr())) {
+                // the leading slack goes back into the free list
+                const size_t slack {data - reinterpret_cast<size_t>(block->data_ptr())};
+
+                used = new (reinterpret_cast<void *>(data - sizeof(header_used))) header_used(block->size() - slack);
+                block->size(slack - sizeof(header_used));
+                insert(block);
+            }
+
+            used->is_free(false);
+            following_prev_free(used, false);
+
+            resize(used, size);
+
+            return used;
+        }
+
+        // resize a used block without moving it, false if it cannot grow
+        bool resize(header_used *block, size_t size)
+        {
+            if (size > mem.size()) {
+                return false;
+            }
+
+            size = HEAP_MAX(size, ALIGNMENT);
+            size = align(size);
+
+            if (size > block->size()) {
+                auto *following = block->following_block(mem);
+
+                if (not following or not following->is_free() or
+                    block->size() + sizeof(header_used) + following->size() < size) {
+                    return false;
+                }
+
+                remove(static_cast<header_free *>(following));
+                block->size(block->size() + sizeof(header_used) + following->size());
+                following_prev_free(block, false);
+            }
+
+            const size_t size_remaining {block->size() - size};
+
+            if (size_remaining >= min_split()) {
+                // split off the tail, insert merges it with a free follower
+                block->size(size);
+                insert(new (block->following_block(mem)) header_free(size_remaining - sizeof(header_used)));
+            }
+
+            return true;
         }
 
-        bool ptr_in_range(void *p)
+        bool ptr_in_range(void *p) const
         {
             return reinterpret_cast<size_t>(p) >= mem.base() and reinterpret_cast<size_t>(p) < mem.end();
         }
 
     private:
-        memory &mem;
-        header_free *list;
+        static constexpr size_t NO_BLOCK {~0ul};
+
+        size_t offset_of(const header_free *val) const
+        {
+            return val ? reinterpret_cast<size_t>(val) - mem.base() : NO_BLOCK;
+        }
+
+        header_free *block_at(size_t offset) const
+        {
+            return offset != NO_BLOCK ? reinterpret_cast<header_free *>(mem.base() + offset) : nullptr;
+        }
+
+        // a free block header could be at val
+        bool plausible(const header_free *val) const
+        {
+            const size_t addr {reinterpret_cast<size_t>(val)};
+
+            return addr >= mem.base() and addr <= mem.end() - sizeof(header_free) and
+                   ((addr + sizeof(header_used)) & (ALIGNMENT - 1)) == 0;
+        }
+
+        // every node of the index is a plausible free block, at most budget
+        bool verify_tree(const header_free *tree, size_t &budget) const
+        {
+            if (not tree) {
+                return true;
+            }
+
+            if (budget == 0 or not plausible(tree) or not tree->is_free()) {
+                return false;
+            }
+
+            budget--;
+            return verify_tree(tree->left(), budget) and verify_tree(tree->right(), budget);
+        }
+
+        // the block in front of a request of size in its quick list
+        header_used *quick_pop(size_t size)
+        {
+            const size_t idx {quick_index(size)};
+
+            if (idx >= quick_lists() or not quick[idx]) {
+                return nullptr;
+            }
+
+            auto *block = quick[idx];
+
+            quick[idx] = *static_cast<header_used **>(block->data_ptr());
+            block->deferred(false);
+            deferred_bytes_ -= block->size();
+            counters.undeferred(block->size());
+            return block;
+        }
+
+        MEMORY &mem;
+        header_free *lists[num_lists()];
+        size_t list_map {0};
+
+        // deferred mode: LIFO lists of freed blocks linked through their
+        // data, one per block size up to 16 * ALIGNMENT bytes
+        header_used *quick[quick_lists() ? quick_lists() : 1];
+        size_t deferred_bytes_ {0};
+
+        header_free *index {nullptr};
+
+        // bytes inside free blocks given back to the system
+        size_t released {0};
+
+        // the prev_free flag of the end of the memory: the last block is free
+        bool last_free_ {false};
+
+        // next fit: the next search starts at the first block at or behind
+        // resume, rover is a free block in front of it to start looking from
+        header_free *rover  {nullptr};
+        size_t       resume {0};
+
+    public:
+        heap_counters<> counters;
+    };
+
+    void *allocated(header_used *block)
+    {
+        if (not block) {
+            free_list.counters.failed();
+            return nullptr;
+        }
+
+        free_list.counters.allocated(block->size());
+        return block->data_ptr();
+    }
+
+    // Huge blocks are mapped separately and kept in a list, their header_used
+    // sits right in front of the data like for any other block.
+    struct huge_block
+    {
+        huge_block *next;
+        huge_block *prev;
+        size_t      bytes;
+        size_t      tag;
     };
 
+    // marks a huge block as mapped by this heap
+    size_t huge_tag(const huge_block *huge) const
+    {
+        return reinterpret_cast<size_t>(huge) ^ reinterpret_cast<size_t>(this) ^ 0x6b636f6c62656775ul;
+    }
+
+    // data of a huge block starts aligned behind its header, which follows
+    // the bookkeeping at the start of the mapping
+    static constexpr size_t huge_offset()
+    {
+        return (sizeof(huge_block) + sizeof(header_used) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    void *alloc_huge(size_t size)
+    {
+        const size_t page {mem.page_size()};
+        const size_t bytes {(size + huge_offset() + page - 1) & ~(page - 1)};
+
+        if (bytes < size) {
+            return nullptr;
+        }
+
+        auto *huge = static_cast<huge_block *>(mem.map(bytes));
+
+        if (not huge) {
+            return nullptr;
+        }
+
+        huge->bytes = bytes;
+        huge->tag   = huge_tag(huge);
+        huge->prev  = nullptr;
+        huge->next  = huge_list;
+
+        if (huge_list) {
+            huge_list->prev = huge;
+        }
+
+        huge_list = huge;
+
+        auto *header = new (reinterpret_cast<char *>(huge) + huge_offset() - sizeof(header_used)) header_used(bytes - huge_offset());
+        return header->data_ptr();
+    }
+
+    // A huge block starts its mapping, so only pointers huge_offset() behind
+    // a page boundary can be one. Its bookkeeping then lies in the page of p
+    // and is recognized by the tag without walking the list. p must not
+    // point into a huge block that was freed already.
+    huge_block *find_huge(void *p) const
+    {
+        const size_t addr {reinterpret_cast<size_t>(p) - huge_offset()};
+
+        if (not huge_list or reinterpret_cast<size_t>(p) < huge_offset() or (addr & (mem.page_size() - 1))) {
+            return nullptr;
+        }
+
+        auto *huge = reinterpret_cast<huge_block *>(addr);
+        return huge->tag == huge_tag(huge) ? huge : nullptr;
+    }
+
+    void free_huge(huge_block *huge)
+    {
+        if (huge->next) {
+            huge->next->prev = huge->prev;
+        }
+
+        if (huge->prev) {
+            huge->prev->next = huge->next;
+        } else {
+            huge_list = huge->next;
+        }
+
+        huge->tag = 0;
+        mem.unmap(huge, huge->bytes);
+    }
+
+    // release the pages of a free block that grew above the trim threshold
+    void trim_merged(header_free *merged)
+    {
+        if (trim_threshold_ and merged->size() >= trim_threshold_) {
+            free_list.trim(merged);
+        }
+    }
+
+    // heap sort, there is no standard library in freestanding builds
+    static void sort_by_address(void **ptrs, size_t count)
+    {
+        auto less = [ptrs](size_t a, size_t b) { return reinterpret_cast<size_t>(ptrs[a]) < reinterpret_cast<size_t>(ptrs[b]); };
+        auto swap = [ptrs](size_t a, size_t b) { void *tmp = ptrs[a]; ptrs[a] = ptrs[b]; ptrs[b] = tmp; };
+
+        auto sift_down = [&](size_t root, size_t end) {
+            for (size_t child; (child = 2 * root + 1) < end; root = child) {
+                if (child + 1 < end and less(child, child + 1)) {
+                    child++;
+                }
+                if (not less(root, child)) {
+                    return;
+                }
+                swap(root, child);
+            }
+        };
+
+        for (size_t i = count / 2; i-- > 0;) {
+            sift_down(i, count);
+        }
+
+        for (size_t end = count; end-- > 1;) {
+            swap(0, end);
+            sift_down(0, end);
+        }
+    }
+
 private:
-    memory &mem;
+    MEMORY &mem;
 
     free_list_container free_list;
 
+    size_t trim_threshold_ {0};
+
+    size_t      huge_threshold_ {0};
+    huge_block *huge_list       {nullptr};
+
+    size_t deferred_limit_ {64 << 10};
+
 public:
-    first_fit_heap(memory &mem_) : mem(mem_), free_list(mem_, new(reinterpret_cast<void *>(mem_.base())) header_free(mem_.size() - sizeof(header_used)))
+    first_fit_heap(MEMORY &mem_)
+        : mem(mem_)
+        , free_list(mem_, new(reinterpret_cast<void *>(mem_.base() + blocks::lead()))
+                          header_free(mem_.size() - blocks::lead() - sizeof(header_used) - blocks::trail()))
+    {
+    }
+
+    // Continue a heap with HEAP_MODE_OFFSETS from the roots it saved, on
+    // memory holding its blocks at any base address. The memory is not
+    // touched, check it with verify() before use.
+    first_fit_heap(MEMORY &mem_, const heap_roots &roots)
+        : mem(mem_)
+        , free_list(mem_, roots)
     {
+        static_assert(offsets(), "only heaps with HEAP_MODE_OFFSETS can be reattached");
     }
 
     void *alloc(size_t size)
     {
+        if (huge_threshold_ and size >= huge_threshold_) {
+            void *p = alloc_huge(size);
+
+            if (p) {
+                free_list.counters.allocated(usable_size(p));
+                return p;
+            }
+        }
+
         auto *block = free_list.alloc(size);
-        return block ? block->data_ptr() : nullptr;
+
+        if (not block and free_list.extend(size)) {
+            block = free_list.alloc(size);
+        }
+
+        return allocated(block);
     }
 
     void free(void *p)
     {
+        if (not p) {
+            return;
+        }
+
         header_free *header {reinterpret_cast<header_free *>(reinterpret_cast<char *>(p) - sizeof(header_used))};
 
-        if (not p or not free_list.ptr_in_range(header)) {
+        if (not free_list.ptr_in_range(header)) {
+            auto *huge = find_huge(p);
+
+            if (huge) {
+                ASSERT_HEAP(header->canary_alive());
+                free_list.counters.released(header->size());
+                free_huge(huge);
+            }
+
             return;
         }
 
         ASSERT_HEAP(header->canary_alive());
-        ASSERT_HEAP(not header->is_free());
+        ASSERT_HEAP(not header->is_free() and not header->deferred());
+
+        free_list.counters.released(header->size());
+
+        if (deferred()) {
+            if (free_list.deferred_bytes() + header->size() > deferred_limit_) {
+                consolidate();
+            } else if (free_list.defer(header)) {
+                return;
+            }
+        }
+
+        trim_merged(*free_list.insert(header));
+    }
+
+    // Allocate count blocks of size bytes and store them in out. The blocks
+    // are cut from as few free blocks as possible, each split in one pass.
+    // Returns how many blocks were allocated, less than count if the heap
+    // ran out of memory.
+    size_t alloc_n(size_t size, size_t count, void **out)
+    {
+        if (huge_threshold_ and size >= huge_threshold_) {
+            size_t n {0};
+
+            while (n < count and (out[n] = alloc(size))) {
+                n++;
+            }
+
+            return n;
+        }
+
+        size_t n {free_list.alloc_n(size, count, out)};
+
+        const size_t stride {free_list.block_bytes(size)};
+
+        if (n < count and size < (~0ul >> 2) and count - n < (~0ul >> 2) / stride and free_list.extend((count - n) * stride)) {
+            n += free_list.alloc_n(size, count - n, out + n);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            free_list.counters.allocated(usable_size(out[i]));
+        }
+
+        if (n < count) {
+            free_list.counters.failed();
+        }
+
+        return n;
+    }
+
+    // Free count blocks at once. ptrs is sorted by address in place and the
+    // blocks are merged into the free lists in a single sweep.
+    void free_n(void **ptrs, size_t count)
+    {
+        size_t n {0};
+
+        // null pointers are skipped, huge ones take the usual path
+        for (size_t i = 0; i < count; i++) {
+            if (not ptrs[i]) {
+                continue;
+            }
+
+            auto *header = reinterpret_cast<header_used *>(reinterpret_cast<char *>(ptrs[i]) - sizeof(header_used));
+
+            if (not free_list.ptr_in_range(header)) {
+                free(ptrs[i]);
+                continue;
+            }
+
+            ASSERT_HEAP(header->canary_alive());
+            ASSERT_HEAP(not header->is_free() and not header->deferred());
+
+            free_list.counters.released(header->size());
+            ptrs[n++] = ptrs[i];
+        }
+
+        sort_by_address(ptrs, n);
+
+        free_list.insert_n(ptrs, n, [this](header_free *merged) { trim_merged(merged); });
+    }
+
+    // Allocate size bytes at an address aligned to alignment, a power of two.
+    // Slack in front of the block becomes a free block of its own, the result
+    // is released with free() as usual.
+    void *alloc_aligned(size_t size, size_t alignment)
+    {
+        // every block has the heap's alignment, growing and huge blocks included
+        if (alignment <= ALIGNMENT) {
+            return alloc(size);
+        }
+
+        return allocated(free_list.alloc_aligned(size, alignment));
+    }
+
+    // Resize the block at p. It shrinks and grows into a free following block
+    // in place, otherwise the data moves to a new block with the heap's
+    // ALIGNMENT. On failure nullptr is returned and p stays valid.
+    void *realloc(void *p, size_t size)
+    {
+        if (not p) {
+            return alloc(size);
+        }
+
+        auto *header = reinterpret_cast<header_used *>(reinterpret_cast<char *>(p) - sizeof(header_used));
+
+        ASSERT_HEAP(header->canary_alive());
+        ASSERT_HEAP(not header->is_free() and not header->deferred());
+
+        const size_t old_size {header->size()};
+
+        // huge blocks always move
+        if (free_list.ptr_in_range(header) and free_list.resize(header, size)) {
+            free_list.counters.resized(old_size, header->size());
+            return p;
+        }
+
+        void *moved = alloc(size);
+
+        if (moved) {
+            __builtin_memcpy(moved, p, size < header->size() ? size : header->size());
+            free(p);
+        }
+
+        return moved;
+    }
+
+    // number of bytes usable at p, at least the size it was allocated with
+    size_t usable_size(void *p) const
+    {
+        const auto *header = reinterpret_cast<const header_used *>(reinterpret_cast<char *>(p) - sizeof(header_used));
+
+        ASSERT_HEAP(not header->is_free() and not header->deferred());
+        return header->size();
+    }
+
+    // alloc maps requests of at least bytes separately through the memory,
+    // 0 turns this off
+    void huge_threshold(size_t bytes) { huge_threshold_ = bytes; }
+
+    // true for pointers into the heap range or to a huge block
+    bool ptr_in_range(void *p) const
+    {
+        return free_list.ptr_in_range(p) or find_huge(p);
+    }
+
+    // bytes mapped for huge blocks
+    size_t mapped_mem() const
+    {
+        size_t bytes {0};
+
+        for (auto *huge = huge_list; huge; huge = huge->next) {
+            bytes += huge->bytes;
+        }
+
+        return bytes;
+    }
+
+    // Give the pages inside all free blocks back to the system, returns the
+    // number of bytes released by this call. Block metadata stays in place.
+    size_t trim() { return free_list.trim(); }
 
-        free_list.insert(header);
+    // free releases the pages of merged free blocks of at least bytes right
+    // away, 0 turns this off
+    void trim_threshold(size_t bytes) { trim_threshold_ = bytes; }
+
+    // bytes currently released by trim
+    size_t released_mem() const { return free_list.released_mem(); }
+
+    // Free list roots to reattach the heap from. Huge blocks and blocks
+    // waiting in the quick lists cannot be saved, consolidate() first.
+    heap_roots roots() const
+    {
+        static_assert(offsets(), "only heaps with HEAP_MODE_OFFSETS can be reattached");
+        ASSERT_HEAP(not huge_list);
+        return free_list.roots();
+    }
+
+    // Continue from roots saved by another heap on the same memory, like a
+    // heap in memory shared with other processes
+    void reattach(const heap_roots &roots)
+    {
+        static_assert(offsets(), "only heaps with HEAP_MODE_OFFSETS can be reattached");
+        ASSERT_HEAP(not huge_list);
+        free_list.restore(roots);
     }
 
+    // Deferred mode: free merges all blocks waiting in the quick lists once
+    // they would hold more than bytes, 0 turns deferring off
+    void deferred_limit(size_t bytes) { deferred_limit_ = bytes; }
+
+    // merge all blocks waiting in the quick lists into the free lists
+    void consolidate() { free_list.consolidate([this](header_free *merged) { trim_merged(merged); }); }
+
+    // upper bound of the memory actually backed by pages
+    size_t resident_mem() const { return mem.size() - free_list.released_mem(); }
+
     void check_integrity()
     {
-        header_used* h {reinterpret_cast<header_used*>(mem.base())};
-        while (size_t(h) < mem.end()) {
+        header_used* h {reinterpret_cast<header_used*>(mem.base() + blocks::lead())};
+        size_t marked {0};
+        [[maybe_unused]] bool last_free {false};
+        while (size_t(h) + blocks::trail() < mem.end()) {
             ASSERT_HEAP(h->canary_alive());
+            marked += h->deferred();
+            last_free = h->is_free();
             h = reinterpret_cast<header_used*>(reinterpret_cast<char*>(h) + h->size() + sizeof(header_used));
         }
+        ASSERT_HEAP(last_free == free_list.last_free());
+
+        for (auto *huge = huge_list; huge; huge = huge->next) {
+            ASSERT_HEAP(reinterpret_cast<header_used *>(reinterpret_cast<char *>(huge) + huge_offset() - sizeof(header_used))->canary_alive());
+        }
+
+        // blocks in the quick lists are marked, used and of their list's size
+        size_t deferred_cnt {0}, deferred_size {0};
+
+        free_list.for_each_deferred([&](header_used *block, [[maybe_unused]] size_t idx) {
+            ASSERT_HEAP(free_list.ptr_in_range(block));
+            ASSERT_HEAP(block->canary_alive());
+            ASSERT_HEAP(block->deferred() and not block->is_free());
+            ASSERT_HEAP(free_list_container::quick_index(block->size()) == idx);
+            deferred_cnt++;
+            deferred_size += block->size();
+        });
+
+        ASSERT_HEAP(deferred_cnt == marked);
+        ASSERT_HEAP(deferred_size == free_list.deferred_bytes());
+
+        if (HEAP_STATS) {
+            size_t cnt {0}, size {0};
+
+            free_list.for_each([&](header_free *elem) { cnt++; size += elem->size(); });
+
+            ASSERT_HEAP(cnt == free_list.counters.get().free_blocks);
+            ASSERT_HEAP(size == free_list.counters.get().free_bytes);
+            ASSERT_HEAP(deferred_cnt == free_list.counters.get().deferred_blocks);
+            ASSERT_HEAP(deferred_size == free_list.counters.get().deferred_bytes);
+        }
     }
 
+    // Walk all blocks and free lists like check_integrity, but report damage
+    // instead of asserting. Meant for memory in an unknown state, like a
+    // heap that was reattached.
+    bool verify()
+    {
+        const size_t stop {mem.end() - blocks::trail()};
+        size_t free_blocks {0}, free_bytes {0}, deferred_blocks {0};
+        bool   prev_free {false};
+
+        for (size_t addr {mem.base() + blocks::lead()}; addr != stop;) {
+            auto *h = reinterpret_cast<header_used *>(addr);
+
+            if (addr > stop - sizeof(header_used) or not h->canary_alive() or h->prev_free() != prev_free) {
+                return false;
+            }
+
+            const size_t data {addr + sizeof(header_used)};
+
+            if (h->size() > stop - data or (data & (ALIGNMENT - 1))) {
+                return false;
+            }
+
+            if (h->is_free()) {
+                // free neighbours are always merged
+                if (prev_free or h->deferred() or static_cast<header_free *>(h)->get_footer()->size() != h->size()) {
+                    return false;
+                }
+
+                free_blocks++;
+                free_bytes += h->size();
+            }
+
+            deferred_blocks += h->deferred();
+            prev_free = h->is_free();
+            addr      = data + h->size();
+        }
+
+        if (prev_free != free_list.last_free()) {
+            return false;
+        }
+
+        const auto stats {free_list.counters.get()};
+
+        if (HEAP_STATS and (stats.free_blocks != free_blocks or stats.free_bytes != free_bytes or
+                            stats.deferred_blocks != deferred_blocks)) {
+            return false;
+        }
+
+        return free_list.verify(free_blocks, free_bytes) and free_list.verify_deferred(deferred_blocks);
+    }
+
+    // free blocks including the ones waiting in the quick lists
     size_t num_blocks() const
     {
+        if (HEAP_STATS) {
+            return free_list.counters.get().free_blocks + free_list.counters.get().deferred_blocks;
+        }
+
         size_t cnt {0};
 
-        for (auto HEAP_UNUSED elem : free_list) {
-            cnt++;
-        }
+        free_list.for_each([&cnt](header_free *) { cnt++; });
+        free_list.for_each_deferred([&cnt](header_used *, size_t) { cnt++; });
 
         return cnt;
     }
 
     size_t free_mem() const
     {
-        size_t size {0};
-
-        for (auto  elem : free_list) {
-            size += elem->size();
+        if (HEAP_STATS) {
+            return free_list.counters.get().free_bytes + free_list.counters.get().deferred_bytes;
         }
 
+        size_t size {free_list.deferred_bytes()};
+
+        free_list.for_each([&size](header_free *elem) { size += elem->size(); });
+
         return size;
     }
 
+    // running counters, all zero with HEAP_DISABLE_STATS
+    heap_stats stats() const { return free_list.counters.get(); }
+
+    size_t largest_free_block() const { return free_list.largest_free(); }
+
+    // 0 if all free memory is one block, towards 1 the more it is scattered
+    double fragmentation() const
+    {
+        const size_t free {free_mem()};
+        return free ? 1. - static_cast<double>(largest_free_block()) / free : 0.;
+    }
+
+    // number of free blocks per power of two size class
+    void histogram(size_t (&bins)[sizeof(size_t) * 8]) const
+    {
+        for (auto &bin : bins) {
+            bin = 0;
+        }
+
+        free_list.for_each([&bins](header_free *elem) { bins[sizeof(size_t) * 8 - 1 - __builtin_clzl(elem->size())]++; });
+    }
+
     constexpr size_t alignment() const { return ALIGNMENT; }
 };
@@ -0,0 +1,138 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "heap.hpp"
+
+#ifndef HEAP_LINUX
+    #error "heap_resource builds on the standard library and is only available with HEAP_LINUX"
+#endif
+
+#if __cplusplus < 201703L
+    #error "heap_resource needs C++17 for std::pmr"
+#endif
+
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+// Polymorphic memory resource on top of a heap. Alignments above the heap's
+// ALIGNMENT are served with alloc_aligned, failures throw std::bad_alloc.
+template <class HEAP>
+class first_fit_memory_resource : public std::pmr::memory_resource
+{
+public:
+    first_fit_memory_resource(HEAP &heap) : heap_(heap) {}
+
+    HEAP &heap() const { return heap_; }
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        void *p = heap_.alloc_aligned(bytes, alignment);
+
+        if (not p) {
+            throw std::bad_alloc();
+        }
+
+        return p;
+    }
+
+    void do_deallocate(void *p, [[maybe_unused]] size_t bytes, size_t) override
+    {
+        ASSERT_HEAP(heap_.usable_size(p) >= bytes);
+        heap_.free(p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        auto *resource = dynamic_cast<const first_fit_memory_resource *>(&other);
+        return resource and &resource->heap_ == &heap_;
+    }
+
+    HEAP &heap_;
+};
+
+// Allocator for standard containers, all copies and rebinds share one heap.
+template <class T, class HEAP = first_fit_heap<>>
+class first_fit_allocator
+{
+public:
+    using value_type = T;
+
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap            = std::true_type;
+
+    template <class U>
+    struct rebind
+    {
+        using other = first_fit_allocator<U, HEAP>;
+    };
+
+    first_fit_allocator(HEAP &heap) noexcept : heap_(&heap) {}
+
+    template <class U>
+    first_fit_allocator(const first_fit_allocator<U, HEAP> &other) noexcept : heap_(&other.heap()) {}
+
+    T *allocate(size_t n)
+    {
+        if (n > ~0ul / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+
+        void *p = heap_->alloc_aligned(n * sizeof(T), alignof(T));
+
+        if (not p) {
+            throw std::bad_alloc();
+        }
+
+        return static_cast<T *>(p);
+    }
+
+    // n is the size passed to allocate, the heap finds the block size itself
+    void deallocate(T *p, [[maybe_unused]] size_t n)
+    {
+        ASSERT_HEAP(heap_->usable_size(p) >= n * sizeof(T));
+        heap_->free(p);
+    }
+
+    HEAP &heap() const noexcept { return *heap_; }
+
+private:
+    HEAP *heap_;
+};
+
+template <class T, class U, class HEAP>
+bool operator==(const first_fit_allocator<T, HEAP> &a, const first_fit_allocator<U, HEAP> &b) noexcept
+{
+    return &a.heap() == &b.heap();
+}
+
+template <class T, class U, class HEAP>
+bool operator!=(const first_fit_allocator<T, HEAP> &a, const first_fit_allocator<U, HEAP> &b) noexcept
+{
+    return not (a == b);
+}
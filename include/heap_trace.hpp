@@ -0,0 +1,216 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "heap.hpp"
+
+#ifndef HEAP_LINUX
+    #error "heap traces are written to files and only available with HEAP_LINUX"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+// One alloc or free in a trace. Blocks are named by handles numbered in
+// allocation order, so traces do not depend on addresses.
+struct HEAP_PACKED heap_trace_record
+{
+    enum : uint8_t { ALLOC, FREE, REALLOC };
+
+    uint64_t timestamp;   // ns since the trace started
+    uint64_t size;        // requested size, 0 for free
+    uint32_t handle;
+    uint8_t  op;
+};
+
+static constexpr char HEAP_TRACE_MAGIC[8] {'H', 'E', 'A', 'P', 'T', 'R', 'C', '1'};
+
+// Wraps a heap and records every call into a ring buffer of records that
+// is written to a file whenever it fills up and on flush().
+template <class HEAP>
+class traced_heap
+{
+private:
+    using clock = std::chrono::steady_clock;
+
+    void record(uint8_t op, uint64_t size, uint32_t handle)
+    {
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+
+        ring[head++ % ring.size()] = {ns, size, handle, op};
+
+        if (head - tail == ring.size()) {
+            flush();
+        }
+    }
+
+    static constexpr uint32_t NO_HANDLE {~0u};
+
+    // the handle of a traced block, which is forgotten, or NO_HANDLE for
+    // blocks from before tracing or from elsewhere
+    uint32_t handle_of(void *p)
+    {
+        auto it = handles.find(p);
+
+        if (it == handles.end()) {
+            return NO_HANDLE;
+        }
+
+        const uint32_t handle {it->second};
+        handles.erase(it);
+        return handle;
+    }
+
+public:
+    traced_heap(memory &mem, const char *path, size_t capacity = 4096)
+        : ring(capacity), file(fopen(path, "wb")), start(clock::now()), heap_(mem)
+    {
+        ASSERT_HEAP(file);
+
+        if (file) {
+            fwrite(HEAP_TRACE_MAGIC, sizeof(HEAP_TRACE_MAGIC), 1, file);
+        }
+    }
+
+    ~traced_heap()
+    {
+        flush();
+
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    traced_heap(const traced_heap &) = delete;
+    traced_heap &operator=(const traced_heap &) = delete;
+
+    void *alloc(size_t size)
+    {
+        void *p = heap_.alloc(size);
+
+        if (p) {
+            handles[p] = next_handle;
+            record(heap_trace_record::ALLOC, size, next_handle++);
+        }
+
+        return p;
+    }
+
+    void free(void *p)
+    {
+        const uint32_t handle {p ? handle_of(p) : NO_HANDLE};
+
+        if (handle != NO_HANDLE) {
+            record(heap_trace_record::FREE, 0, handle);
+        }
+
+        heap_.free(p);
+    }
+
+    void *realloc(void *p, size_t size)
+    {
+        if (not p) {
+            return alloc(size);
+        }
+
+        void *moved = heap_.realloc(p, size);
+
+        if (moved) {
+            const uint32_t handle {handle_of(p)};
+
+            // an untraced block enters the trace like a new one
+            if (handle == NO_HANDLE) {
+                handles[moved] = next_handle;
+                record(heap_trace_record::ALLOC, size, next_handle++);
+            } else {
+                handles[moved] = handle;
+                record(heap_trace_record::REALLOC, size, handle);
+            }
+        }
+
+        return moved;
+    }
+
+    // write all buffered records to the file
+    void flush()
+    {
+        while (tail != head) {
+            const size_t idx {tail % ring.size()};
+            const size_t cnt {std::min(head - tail, ring.size() - idx)};
+
+            if (file) {
+                fwrite(&ring[idx], sizeof(heap_trace_record), cnt, file);
+            }
+
+            tail += cnt;
+        }
+
+        if (file) {
+            fflush(file);
+        }
+    }
+
+    HEAP &heap() { return heap_; }
+
+private:
+    std::vector<heap_trace_record> ring;
+    size_t head {0};
+    size_t tail {0};
+
+    FILE *file;
+    clock::time_point start;
+
+    std::unordered_map<void *, uint32_t> handles;
+    uint32_t next_handle {0};
+
+    HEAP heap_;
+};
+
+// Read all records of a trace file, false if it is no trace
+static inline bool read_heap_trace(const char *path, std::vector<heap_trace_record> &records)
+{
+    FILE *file = fopen(path, "rb");
+    char magic[sizeof(HEAP_TRACE_MAGIC)];
+
+    if (not file) {
+        return false;
+    }
+
+    if (fread(magic, sizeof(magic), 1, file) != 1 or not std::equal(magic, magic + sizeof(magic), HEAP_TRACE_MAGIC)) {
+        fclose(file);
+        return false;
+    }
+
+    heap_trace_record record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
+    }
+
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,296 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "heap.hpp"
+
+#ifndef HEAP_LINUX
+    #error "persistent_heap maps files and is only available with HEAP_LINUX"
+#endif
+
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Memory backed by a file that is mapped shared, everything written to it
+// ends up in the file. An empty or new file is extended to size bytes, an
+// existing one is mapped with its own size. size() is 0 if the file could
+// not be mapped.
+class file_memory final : public memory
+{
+private:
+    int    fd_      {-1};
+    size_t base_    {0};
+    size_t size_    {0};
+    bool   created_ {false};
+
+    void map_file(size_t size)
+    {
+        struct stat st;
+
+        if (fd_ < 0 or fstat(fd_, &st) != 0) {
+            return;
+        }
+
+        created_ = st.st_size == 0;
+
+        if (created_ and ftruncate(fd_, size) != 0) {
+            return;
+        }
+
+        size = created_ ? size : st.st_size;
+
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+
+        if (p != MAP_FAILED) {
+            base_ = reinterpret_cast<size_t>(p);
+            size_ = size;
+        }
+    }
+
+public:
+    file_memory(const char *path, size_t size)
+        : fd_(open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600))
+    {
+        map_file(size);
+    }
+
+    // a file that is already open, like a shared memory object or a memfd,
+    // fd stays with the caller
+    file_memory(int fd, size_t size)
+        : fd_(fcntl(fd, F_DUPFD_CLOEXEC, 0))
+    {
+        map_file(size);
+    }
+
+    virtual ~file_memory()
+    {
+        if (size_) {
+            munmap(reinterpret_cast<void *>(base_), size_);
+        }
+
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    file_memory(const file_memory &) = delete;
+    file_memory &operator=(const file_memory &) = delete;
+
+    virtual size_t base() const { return base_; }
+    virtual size_t size() const { return size_; }
+    virtual size_t end()  const { return base_ + size_; }
+
+    virtual size_t page_size() const { return sysconf(_SC_PAGESIZE); }
+
+    // punches a hole into the file
+    virtual bool release(size_t addr, size_t bytes)
+    {
+        return madvise(reinterpret_cast<void *>(addr), bytes, MADV_REMOVE) == 0;
+    }
+
+    // the file was empty and got its size from the constructor
+    bool created() const { return created_; }
+
+    bool sync(size_t addr, size_t bytes)
+    {
+        return msync(reinterpret_cast<void *>(addr), bytes, MS_SYNC) == 0;
+    }
+};
+
+// The part of a file_memory behind its first offset bytes
+class file_region final : public memory
+{
+public:
+    file_region(file_memory &file_, size_t offset) : file(file_), offset_(offset) {}
+
+    size_t base() const override { return file.base() + offset_; }
+    size_t size() const override { return file.size() - offset_; }
+    size_t end()  const override { return file.end(); }
+
+    size_t page_size() const override { return file.page_size(); }
+
+    bool release(size_t addr, size_t bytes) override { return file.release(addr, bytes); }
+
+private:
+    file_memory &file;
+    size_t       offset_;
+};
+
+// Layout of the first page of a persistent heap file, the heap memory
+// follows it.
+struct persistent_superblock
+{
+    static constexpr uint64_t MAGIC   {0x7061656874737266ul}; // "frstheap"
+    static constexpr uint32_t VERSION {2};
+
+    // build options that change the block layout, compact headers keep a
+    // canary in the size word with asserts
+    static constexpr uint64_t layout() { return (HEAP_ASSERTS ? 1 : 0) | (HEAP_STATS ? 2 : 0); }
+
+    uint64_t   magic;
+    uint32_t   version;
+    uint32_t   mode;
+    uint64_t   alignment;
+    uint64_t   config;
+    uint64_t   size;      // bytes of heap memory behind the superblock
+    uint64_t   clean;     // closed properly, the roots match the blocks
+    uint64_t   root;      // offset of the application's root object
+    heap_roots roots;
+};
+
+// A heap in a file that is opened again without rebuilding it. The blocks
+// only refer to each other by distance and the superblock keeps the free
+// list roots as offsets, so the file can be mapped at any address. Objects
+// in the heap have to do the same and link to each other with offset_of()
+// and at(), root() is where the application starts looking.
+//
+// The roots are written when the heap is destroyed. A file that was not
+// closed that way, or whose blocks do not pass verify(), is not opened.
+template <size_t ALIGNMENT = HEAP_MIN_ALIGNMENT, unsigned MODE = HEAP_MODE_DEFAULT>
+class persistent_heap
+{
+public:
+    using heap_type = first_fit_heap<ALIGNMENT, MODE | HEAP_MODE_OFFSETS>;
+
+private:
+    static constexpr uint64_t NO_ROOT {~0ul};
+
+    persistent_superblock &super() const { return *reinterpret_cast<persistent_superblock *>(file.base()); }
+
+    bool matches(const persistent_superblock &sb) const
+    {
+        return sb.magic == persistent_superblock::MAGIC and sb.version == persistent_superblock::VERSION and
+               sb.mode == MODE and sb.alignment == ALIGNMENT and sb.config == persistent_superblock::layout() and
+               sb.size == mem.size() and sb.clean;
+    }
+
+    void create()
+    {
+        auto &sb = super();
+
+        heap_.reset(new heap_type(mem));
+
+        sb.magic     = persistent_superblock::MAGIC;
+        sb.version   = persistent_superblock::VERSION;
+        sb.mode      = MODE;
+        sb.alignment = ALIGNMENT;
+        sb.config    = persistent_superblock::layout();
+        sb.size      = mem.size();
+        sb.root      = NO_ROOT;
+    }
+
+    void attach()
+    {
+        if (not matches(super())) {
+            return;
+        }
+
+        heap_.reset(new heap_type(mem, super().roots));
+
+        if (not heap_->verify()) {
+            heap_.reset();
+        }
+    }
+
+    static size_t superblock_bytes(size_t page)
+    {
+        const size_t align {page > ALIGNMENT ? page : ALIGNMENT};
+        return (sizeof(persistent_superblock) + align - 1) & ~(align - 1);
+    }
+
+public:
+    // Open the heap in the file at path. A new or empty file becomes a new
+    // heap filling size bytes including the superblock.
+    persistent_heap(const char *path, size_t size)
+        : file(path, size)
+        , mem(file, superblock_bytes(file.page_size()))
+    {
+        if (file.size() <= superblock_bytes(file.page_size())) {
+            return;
+        }
+
+        if (file.created()) {
+            create();
+        } else {
+            attach();
+        }
+
+        // a crash from now on leaves the file marked as not clean
+        if (heap_) {
+            super().clean = 0;
+        }
+    }
+
+    ~persistent_heap()
+    {
+        if (not heap_) {
+            return;
+        }
+
+        heap_->consolidate();
+
+        super().roots = heap_->roots();
+        file.sync(file.base(), file.size());
+
+        super().clean = 1;
+        file.sync(file.base(), mem.base() - file.base());
+    }
+
+    persistent_heap(const persistent_heap &) = delete;
+    persistent_heap &operator=(const persistent_heap &) = delete;
+
+    // false if the file could not be mapped or holds no intact heap of this
+    // type, nothing else may be called then
+    bool valid() const { return heap_ != nullptr; }
+
+    // the heap was created instead of reopened
+    bool created() const { return file.created(); }
+
+    void *alloc(size_t size) { return heap_->alloc(size); }
+    void *alloc_aligned(size_t size, size_t alignment) { return heap_->alloc_aligned(size, alignment); }
+    void *realloc(void *p, size_t size) { return heap_->realloc(p, size); }
+    void  free(void *p) { heap_->free(p); }
+
+    size_t usable_size(void *p) const { return heap_->usable_size(p); }
+
+    // position independent references to objects in the heap
+    size_t offset_of(const void *p) const { return reinterpret_cast<size_t>(p) - mem.base(); }
+    void  *at(size_t offset) const { return reinterpret_cast<void *>(mem.base() + offset); }
+
+    // the object the application finds its data through after reopening
+    void *root() const { return super().root != NO_ROOT ? at(super().root) : nullptr; }
+    void  root(void *p) { super().root = p ? offset_of(p) : NO_ROOT; }
+
+    heap_type &heap() { return *heap_; }
+
+private:
+    file_memory file;
+    file_region mem;
+
+    std::unique_ptr<heap_type> heap_;
+};
@@ -0,0 +1,291 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "persistent_heap.hpp"
+
+#include <errno.h>
+#include <pthread.h>
+
+// First page of a shared heap region, the heap memory follows it
+struct shared_heap_header
+{
+    static constexpr uint64_t MAGIC   {0x6465726168737266ul}; // "frshared"
+    static constexpr uint32_t VERSION {2};
+
+    uint64_t        magic;  // written last by the creator
+    uint32_t        version;
+    uint32_t        mode;
+    uint64_t        alignment;
+    uint64_t        config;
+    uint64_t        size;
+    uint64_t        broken; // a process died in the middle of an operation
+    uint64_t        root;
+    pthread_mutex_t lock;
+    heap_roots      roots;
+};
+
+// A heap in memory shared by processes, a POSIX shared memory object or a
+// memfd. Every process maps it at its own address and keeps a heap of its
+// own on it, which loads the free list roots from the shared header under a
+// robust process shared mutex and stores them back after each operation.
+// Blocks allocated by one process can be handed to another one as an
+// offset, read there in place and freed by it.
+//
+// If a process dies while holding the lock the next one checks the heap
+// with verify(). A heap that does not pass is marked broken, alloc returns
+// nullptr and free does nothing from then on in all processes.
+template <size_t ALIGNMENT = HEAP_MIN_ALIGNMENT, unsigned MODE = HEAP_MODE_DEFAULT>
+class shared_heap
+{
+    static_assert(not (MODE & HEAP_MODE_DEFERRED), "quick lists cannot be shared between processes");
+
+public:
+    using heap_type = first_fit_heap<ALIGNMENT, MODE | HEAP_MODE_OFFSETS>;
+
+private:
+    static constexpr uint64_t NO_ROOT {~0ul};
+
+    shared_heap_header &header() const { return *reinterpret_cast<shared_heap_header *>(file.base()); }
+
+    static size_t header_bytes(size_t page)
+    {
+        const size_t align {page > ALIGNMENT ? page : ALIGNMENT};
+        return (sizeof(shared_heap_header) + align - 1) & ~(align - 1);
+    }
+
+    bool matches(const shared_heap_header &h) const
+    {
+        return __atomic_load_n(&h.magic, __ATOMIC_ACQUIRE) == shared_heap_header::MAGIC and
+               h.version == shared_heap_header::VERSION and h.mode == MODE and h.alignment == ALIGNMENT and
+               h.config == persistent_superblock::layout() and h.size == mem.size();
+    }
+
+    void create()
+    {
+        auto &h = header();
+        pthread_mutexattr_t attr;
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&h.lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        heap_.reset(new heap_type(mem));
+
+        h.version   = shared_heap_header::VERSION;
+        h.mode      = MODE;
+        h.alignment = ALIGNMENT;
+        h.config    = persistent_superblock::layout();
+        h.size      = mem.size();
+        h.broken    = 0;
+        h.root      = NO_ROOT;
+        h.roots     = heap_->roots();
+
+        __atomic_store_n(&h.magic, shared_heap_header::MAGIC, __ATOMIC_RELEASE);
+    }
+
+    void attach()
+    {
+        if (not matches(header())) {
+            return;
+        }
+
+        heap_.reset(new heap_type(mem, header().roots));
+
+        bool intact {false};
+        locked([&intact](heap_type &heap) { intact = heap.verify(); });
+
+        if (not intact) {
+            heap_.reset();
+        }
+    }
+
+    // Take the lock and continue from the shared roots. false if the heap
+    // is broken.
+    bool lock()
+    {
+        auto &h = header();
+        const int err {pthread_mutex_lock(&h.lock)};
+
+        if (err == EOWNERDEAD) {
+            // the roots may not match the blocks anymore
+            heap_->reattach(h.roots);
+
+            if (not heap_->verify()) {
+                __atomic_store_n(&h.broken, 1, __ATOMIC_RELAXED);
+            }
+
+            pthread_mutex_consistent(&h.lock);
+        } else if (err != 0) {
+            return false;
+        }
+
+        if (h.broken) {
+            pthread_mutex_unlock(&h.lock);
+            return false;
+        }
+
+        heap_->reattach(h.roots);
+        return true;
+    }
+
+    void unlock()
+    {
+        header().roots = heap_->roots();
+        pthread_mutex_unlock(&header().lock);
+    }
+
+    shared_heap(int fd, size_t size, bool own_fd)
+        : file(fd, size)
+        , mem(file, header_bytes(file.page_size()))
+    {
+        if (own_fd and fd >= 0) {
+            close(fd);
+        }
+
+        if (file.size() <= header_bytes(file.page_size())) {
+            return;
+        }
+
+        if (not size) {
+            attach();
+        } else if (file.created()) {
+            create();
+        }
+    }
+
+public:
+    // Create a heap of size bytes including the header in the empty file
+    // fd, or attach to the heap in it if size is 0. fd stays with the caller
+    // and can be closed once the heap is set up.
+    shared_heap(int fd, size_t size = 0) : shared_heap(fd, size, false) {}
+
+    // The same with the POSIX shared memory object name, which is created
+    // and must not exist yet if size is given. Attaching fails until the
+    // creator's constructor returned.
+    shared_heap(const char *name, size_t size = 0)
+        : shared_heap(shm_open(name, size ? O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0600), size, true)
+    {
+    }
+
+    shared_heap(const shared_heap &) = delete;
+    shared_heap &operator=(const shared_heap &) = delete;
+
+    // false if the memory could not be mapped or holds no intact heap of
+    // this type, nothing else may be called then
+    bool valid() const { return heap_ != nullptr; }
+
+    bool broken() const { return __atomic_load_n(&header().broken, __ATOMIC_RELAXED); }
+
+    // Run fn(heap_type &) with the heap locked, for several operations no
+    // other process may see half done. false if the heap is broken.
+    template <class FN>
+    bool locked(FN fn)
+    {
+        if (not lock()) {
+            return false;
+        }
+
+        fn(*heap_);
+        unlock();
+        return true;
+    }
+
+    void *alloc(size_t size)
+    {
+        void *p {nullptr};
+        locked([&](heap_type &heap) { p = heap.alloc(size); });
+        return p;
+    }
+
+    void *alloc_aligned(size_t size, size_t alignment)
+    {
+        void *p {nullptr};
+        locked([&](heap_type &heap) { p = heap.alloc_aligned(size, alignment); });
+        return p;
+    }
+
+    void *realloc(void *p, size_t size)
+    {
+        void *moved {nullptr};
+        locked([&](heap_type &heap) { moved = heap.realloc(p, size); });
+        return moved;
+    }
+
+    void free(void *p)
+    {
+        locked([p](heap_type &heap) { heap.free(p); });
+    }
+
+    // the size bits of a used block only change with realloc by its owner
+    size_t usable_size(void *p) const { return heap_->usable_size(p); }
+
+    // position independent references to blocks for other processes
+    size_t offset_of(const void *p) const { return reinterpret_cast<size_t>(p) - mem.base(); }
+    void  *at(size_t offset) const { return reinterpret_cast<void *>(mem.base() + offset); }
+
+    // a block published to all processes
+    void *root() const
+    {
+        const uint64_t root {__atomic_load_n(&header().root, __ATOMIC_ACQUIRE)};
+        return root != NO_ROOT ? at(root) : nullptr;
+    }
+
+    void root(void *p) { __atomic_store_n(&header().root, p ? offset_of(p) : NO_ROOT, __ATOMIC_RELEASE); }
+
+    size_t free_mem()
+    {
+        size_t bytes {0};
+        locked([&bytes](heap_type &heap) { bytes = heap.free_mem(); });
+        return bytes;
+    }
+
+    size_t num_blocks()
+    {
+        size_t blocks {0};
+        locked([&blocks](heap_type &heap) { blocks = heap.num_blocks(); });
+        return blocks;
+    }
+
+    bool verify()
+    {
+        bool intact {false};
+        locked([&intact](heap_type &heap) { intact = heap.verify(); });
+        return intact;
+    }
+
+    void check_integrity()
+    {
+        locked([](heap_type &heap) { heap.check_integrity(); });
+    }
+
+private:
+    file_memory file;
+    file_region mem;
+
+    std::unique_ptr<heap_type> heap_;
+};
@@ -0,0 +1,417 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "heap.hpp"
+
+// Test-and-set lock built on the compiler atomics, usable freestanding.
+class heap_spinlock
+{
+public:
+    void lock()
+    {
+        while (__atomic_exchange_n(&locked, true, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked, __ATOMIC_RELAXED)) {
+#if defined(__x86_64__) or defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+            }
+        }
+    }
+
+    void unlock() { __atomic_store_n(&locked, false, __ATOMIC_RELEASE); }
+
+private:
+    bool locked {false};
+};
+
+template <class LOCK>
+class heap_lock_guard
+{
+public:
+    heap_lock_guard(LOCK &lock_) : lock(lock_) { lock.lock(); }
+    ~heap_lock_guard() { lock.unlock(); }
+
+private:
+    LOCK &lock;
+};
+
+// Pool of fixed size objects carved out of slabs allocated from a heap.
+//
+// A slab is the smallest power of two that holds 64 objects, and it is
+// filled with as many objects as fit behind its header, which keeps a
+// bitmap of the free ones in two words. Objects are taken and returned
+// with atomic operations on that bitmap, the object itself carries no
+// header. Slabs are aligned to their size, so free finds the slab of an
+// object by masking its address. They are cut from chunks of several slabs
+// allocated with alloc_aligned, which keeps the alignment slack to one slab
+// per chunk.
+//
+// Only adding and removing slabs takes the lock, the heap is called with it
+// held. A slab that becomes completely free is unlinked and given back to
+// its chunk once no thread is inside alloc or free anymore. The chunk goes
+// back to the heap with its last slab.
+template <size_t OBJECT_SIZE, class HEAP, class LOCK = heap_spinlock>
+class slab_pool
+{
+private:
+    static constexpr size_t MASK_WORDS  {2};
+    static constexpr size_t CHUNK_SLABS {8};
+
+    static constexpr size_t object_size()
+    {
+        return (OBJECT_SIZE + HEAP_MIN_ALIGNMENT - 1) & ~(HEAP_MIN_ALIGNMENT - 1);
+    }
+
+    static constexpr size_t next_pow2(size_t val, size_t pow2 = 1)
+    {
+        return pow2 >= val ? pow2 : next_pow2(val, pow2 * 2);
+    }
+
+    struct alignas(HEAP_MIN_ALIGNMENT) slab
+    {
+        size_t  free_mask[MASK_WORDS];
+        slab   *next;
+        slab   *chunk;  // first slab of the chunk this one was cut from
+        size_t  in_use; // first slab of a chunk: its slabs handed out
+        size_t  carved; // first slab of a chunk: its slabs cut off so far
+
+        void *object(size_t idx) { return reinterpret_cast<char *>(this + 1) + idx * object_size(); }
+    };
+
+    // less than 128 objects fit, the slab is smaller than 128 of them
+    static constexpr size_t slab_size()   { return next_pow2(64 * object_size()); }
+    static constexpr size_t num_objects() { return (slab_size() - sizeof(slab)) / object_size(); }
+
+    static constexpr size_t full_mask(size_t word)
+    {
+        return num_objects() >= 64 * (word + 1) ? ~0ul
+             : num_objects() > 64 * word        ? (1ul << (num_objects() - 64 * word)) - 1
+                                                : 0;
+    }
+
+    static_assert(sizeof(slab) % HEAP_MIN_ALIGNMENT == 0, "objects have to stay aligned");
+
+    static slab *slab_of(void *p)
+    {
+        return reinterpret_cast<slab *>(reinterpret_cast<size_t>(p) & ~(slab_size() - 1));
+    }
+
+    void enter() { __atomic_fetch_add(&active, 1, __ATOMIC_SEQ_CST); }
+    void leave() { __atomic_fetch_sub(&active, 1, __ATOMIC_SEQ_CST); }
+
+    void *take(slab *s)
+    {
+        for (size_t word = 0; word < MASK_WORDS; word++) {
+            size_t mask {__atomic_load_n(&s->free_mask[word], __ATOMIC_ACQUIRE)};
+
+            while (mask) {
+                const size_t bit {1ul << __builtin_ctzl(mask)};
+
+                if (__atomic_compare_exchange_n(&s->free_mask[word], &mask, mask & ~bit, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    __atomic_store_n(&current, s, __ATOMIC_RELEASE);
+                    return s->object(word * 64 + __builtin_ctzl(bit));
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    static bool all_free(slab *s)
+    {
+        for (size_t word = 0; word < MASK_WORDS; word++) {
+            if (__atomic_load_n(&s->free_mask[word], __ATOMIC_SEQ_CST) != full_mask(word)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Take all objects of a completely free slab at once, concurrent
+    // allocations pass over it then. Lock has to be held.
+    static bool claim(slab *s)
+    {
+        for (size_t word = 0; word < MASK_WORDS; word++) {
+            size_t mask {full_mask(word)};
+
+            if (not __atomic_compare_exchange_n(&s->free_mask[word], &mask, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                while (word--) {
+                    __atomic_fetch_or(&s->free_mask[word], full_mask(word), __ATOMIC_RELEASE);
+                }
+
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // lock has to be held
+    slab *new_slab()
+    {
+        slab *s {spare};
+
+        if (s) {
+            spare = s->next;
+        } else {
+            if (not carving or carving->carved == CHUNK_SLABS) {
+                void *raw = heap.alloc_aligned(CHUNK_SLABS * slab_size(), slab_size());
+
+                if (not raw) {
+                    return nullptr;
+                }
+
+                carving         = static_cast<slab *>(raw);
+                carving->in_use = 0;
+                carving->carved = 0;
+            }
+
+            s        = reinterpret_cast<slab *>(reinterpret_cast<char *>(carving) + carving->carved++ * slab_size());
+            s->chunk = carving;
+        }
+
+        s->chunk->in_use++;
+        return s;
+    }
+
+    // Return a slab nobody can reach anymore to its chunk. Lock has to be
+    // held.
+    void put_slab(slab *s)
+    {
+        slab *chunk {s->chunk};
+
+        if (--chunk->in_use) {
+            s->next = spare;
+            spare   = s;
+            return;
+        }
+
+        for (slab **link = &spare; *link;) {
+            if ((*link)->chunk == chunk) {
+                *link = (*link)->next;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+
+        if (carving == chunk) {
+            carving = nullptr;
+        }
+
+        heap.free(chunk);
+    }
+
+    // Retired slabs go back to their chunks once no other thread is inside
+    // alloc or free, nobody can reach them anymore then. Lock has to be held.
+    void reclaim(size_t self)
+    {
+        if (not retired or __atomic_load_n(&active, __ATOMIC_SEQ_CST) > self) {
+            return;
+        }
+
+        while (retired) {
+            slab *s = retired;
+            retired = s->next;
+            put_slab(s);
+        }
+    }
+
+    // lock has to be held
+    void unlink(slab *s)
+    {
+        slab *prev {nullptr};
+
+        for (slab *it = head; it != s; it = it->next) {
+            prev = it;
+        }
+
+        __atomic_store_n(prev ? &prev->next : &head, s->next, __ATOMIC_SEQ_CST);
+
+        // later allocations must not start at s anymore
+        slab *expected {s};
+        __atomic_compare_exchange_n(&current, &expected, head, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+
+        num_slabs--;
+    }
+
+    void try_release(slab *s)
+    {
+        heap_lock_guard<LOCK> guard(lock);
+
+        // keep the last slab around
+        if (num_slabs > 1 and claim(s)) {
+            unlink(s);
+
+            // A thread still walking s may follow the retired list from
+            // here, it finds no free objects there and grows the pool.
+            __atomic_store_n(&s->next, retired, __ATOMIC_SEQ_CST);
+            retired = s;
+        }
+
+        // the calling free counts as active
+        reclaim(1);
+    }
+
+    void *grow()
+    {
+        heap_lock_guard<LOCK> guard(lock);
+
+        reclaim(0);
+
+        slab *s = new_slab();
+
+        if (not s) {
+            return nullptr;
+        }
+
+        // object 0 goes to the caller
+        for (size_t word = 0; word < MASK_WORDS; word++) {
+            s->free_mask[word] = full_mask(word);
+        }
+
+        s->free_mask[0] &= ~1ul;
+        s->next          = head;
+        __atomic_store_n(&head, s, __ATOMIC_RELEASE);
+        __atomic_store_n(&current, s, __ATOMIC_RELEASE);
+        num_slabs++;
+
+        return s->object(0);
+    }
+
+public:
+    slab_pool(HEAP &heap_) : heap(heap_)
+    {
+        static_assert(num_objects() > 0 and num_objects() < 64 * MASK_WORDS, "objects have to fit the bitmap");
+    }
+
+    ~slab_pool()
+    {
+        for (slab *s = head; s;) {
+            slab *next = s->next;
+            put_slab(s);
+            s = next;
+        }
+
+        for (slab *s = retired; s;) {
+            slab *next = s->next;
+            put_slab(s);
+            s = next;
+        }
+    }
+
+    void *alloc()
+    {
+        void *p {nullptr};
+
+        enter();
+
+        slab *hint {__atomic_load_n(&current, __ATOMIC_ACQUIRE)};
+
+        if (hint) {
+            p = take(hint);
+        }
+
+        for (slab *s = __atomic_load_n(&head, __ATOMIC_ACQUIRE); s and not p; s = __atomic_load_n(&s->next, __ATOMIC_ACQUIRE)) {
+            p = take(s);
+        }
+
+        leave();
+
+        return p ? p : grow();
+    }
+
+    void free(void *p)
+    {
+        if (not p) {
+            return;
+        }
+
+        slab *s {slab_of(p)};
+        const size_t idx {(reinterpret_cast<size_t>(p) - reinterpret_cast<size_t>(s->object(0))) / object_size()};
+        const size_t word {idx / 64};
+        const size_t bit {1ul << idx % 64};
+
+        enter();
+
+        // Sequentially consistent, so of two frees completing different
+        // words at least one sees the whole slab free.
+        const size_t mask {__atomic_fetch_or(&s->free_mask[word], bit, __ATOMIC_SEQ_CST)};
+        ASSERT_HEAP(not (mask & bit));
+
+        if ((mask | bit) == full_mask(word) and all_free(s)) {
+            try_release(s);
+        }
+
+        leave();
+    }
+
+    size_t slabs() const { return __atomic_load_n(&num_slabs, __ATOMIC_RELAXED); }
+
+    static constexpr size_t objects_per_slab() { return num_objects(); }
+
+private:
+    HEAP &heap;
+    LOCK  lock;
+
+    slab  *head      {nullptr};
+    slab  *current   {nullptr};
+    slab  *retired   {nullptr};
+    slab  *spare     {nullptr};
+    slab  *carving   {nullptr};
+    size_t active    {0};
+    size_t num_slabs {0};
+};
+
+// Typed wrapper around a slab_pool that constructs and destroys objects.
+template <class T, class HEAP, class LOCK = heap_spinlock>
+class object_pool
+{
+    static_assert(alignof(T) <= HEAP_MIN_ALIGNMENT, "objects are only aligned to HEAP_MIN_ALIGNMENT");
+
+public:
+    object_pool(HEAP &heap) : pool(heap) {}
+
+    template <class... ARGS>
+    T *create(ARGS &&... args)
+    {
+        void *p = pool.alloc();
+        return p ? new (p) T(static_cast<ARGS &&>(args)...) : nullptr;
+    }
+
+    void destroy(T *obj)
+    {
+        if (obj) {
+            obj->~T();
+            pool.free(obj);
+        }
+    }
+
+    size_t slabs() const { return pool.slabs(); }
+
+private:
+    slab_pool<sizeof(T), HEAP, LOCK> pool;
+};
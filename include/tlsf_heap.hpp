@@ -0,0 +1,322 @@
+/*
+ * MIT License
+
+ * Copyright (c) 2016 - 2018 Thomas Prescher
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "heap.hpp"
+
+// Counts the list and bitmap operations of a tlsf_heap, the default one
+// compiles to nothing.
+struct tlsf_no_steps
+{
+    void step() {}
+};
+
+// Two-level segregated fit heap. Free blocks are kept in doubly linked lists
+// indexed by a first level (power of two) and a second level (linear
+// subdivision of the power of two) size class. Both levels have a bitmap of
+// non-empty lists, so alloc and free run in constant time without any loops.
+template<size_t ALIGNMENT = HEAP_MIN_ALIGNMENT, class STEPS = tlsf_no_steps>
+class tlsf_heap : private STEPS
+{
+private:
+    using blocks      = heap_blocks<ALIGNMENT, true>;
+    using footer      = typename blocks::footer;
+    using header_used = typename blocks::header_used;
+    using header_free = typename blocks::header_free;
+
+    static constexpr size_t min_alignment() { return HEAP_MIN_ALIGNMENT; }
+
+    static constexpr size_t log2(size_t val) { return val > 1 ? 1 + log2(val / 2) : 0; }
+
+    static constexpr size_t size_bits()  { return sizeof(size_t) * 8; }
+    static constexpr size_t sl_bits()    { return 5; }
+    static constexpr size_t sl_count()   { return 1ul << sl_bits(); }
+    static constexpr size_t fl_shift()   { return sl_bits() + log2(ALIGNMENT); }
+    static constexpr size_t fl_count()   { return size_bits() - fl_shift() + 1; }
+    static constexpr size_t small_size() { return 1ul << fl_shift(); }
+
+    static constexpr size_t min_block_size() { return sizeof(header_free) - sizeof(header_used) + sizeof(footer); }
+
+    static size_t floor_log2(size_t val) { return size_bits() - 1 - __builtin_clzl(val); }
+
+    struct index
+    {
+        size_t fl;
+        size_t sl;
+    };
+
+    // Blocks below small_size() are spread linearly over the first level,
+    // larger ones get sl_count() classes per power of two.
+    static index mapping(size_t size)
+    {
+        if (size < small_size()) {
+            return {0, size / (small_size() / sl_count())};
+        }
+
+        const size_t log {floor_log2(size)};
+        return {log - fl_shift() + 1, (size >> (log - sl_bits())) ^ sl_count()};
+    }
+
+    // Round a request up to the next class boundary, every block in the
+    // resulting class is then large enough to hold it.
+    static size_t round_up(size_t size)
+    {
+        if (size >= small_size()) {
+            size += (1ul << (floor_log2(size) - sl_bits())) - 1;
+        }
+
+        return size;
+    }
+
+    size_t align(size_t size) const
+    {
+        size = HEAP_MAX(min_block_size(), size);
+        return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    void insert(header_free *block)
+    {
+        this->step();
+
+        const index idx {mapping(block->size())};
+        auto *&head = lists[idx.fl][idx.sl];
+
+        block->next(head);
+        block->prev(nullptr);
+        block->is_free(true);
+        block->update_footer();
+
+        if (head) {
+            head->prev(block);
+        }
+
+        head = block;
+        sl_map[idx.fl] |= 1u << idx.sl;
+        fl_map |= 1ul << idx.fl;
+
+        auto *following = block->following_block(mem);
+        if (following) {
+            following->prev_free(true);
+        }
+    }
+
+    void remove(header_free *block)
+    {
+        this->step();
+
+        const index idx {mapping(block->size())};
+
+        if (block->next()) {
+            block->next()->prev(block->prev());
+        }
+
+        if (block->prev()) {
+            block->prev()->next(block->next());
+            return;
+        }
+
+        ASSERT_HEAP(lists[idx.fl][idx.sl] == block);
+        lists[idx.fl][idx.sl] = block->next();
+
+        if (not block->next()) {
+            sl_map[idx.fl] &= ~(1u << idx.sl);
+
+            if (not sl_map[idx.fl]) {
+                fl_map &= ~(1ul << idx.fl);
+            }
+        }
+    }
+
+    header_free *find(size_t size)
+    {
+        this->step();
+
+        index idx {mapping(round_up(size))};
+
+        if (idx.fl >= fl_count()) {
+            return nullptr;
+        }
+
+        uint32_t sl_avail = sl_map[idx.fl] & (~0u << idx.sl);
+
+        if (not sl_avail) {
+            const size_t fl_avail {idx.fl + 1 < fl_count() ? fl_map & (~0ul << (idx.fl + 1)) : 0};
+
+            if (not fl_avail) {
+                return nullptr;
+            }
+
+            idx.fl   = __builtin_ctzl(fl_avail);
+            sl_avail = sl_map[idx.fl];
+        }
+
+        return lists[idx.fl][__builtin_ctz(sl_avail)];
+    }
+
+    template <class FN>
+    void for_each(FN fn) const
+    {
+        for (auto &fl : lists) {
+            for (auto *block : fl) {
+                for (; block; block = block->next()) {
+                    fn(block);
+                }
+            }
+        }
+    }
+
+public:
+    tlsf_heap(memory &mem_) : mem(mem_)
+    {
+        ASSERT_HEAP(ALIGNMENT >= min_alignment());
+        ASSERT_HEAP((ALIGNMENT & (ALIGNMENT - 1)) == 0);
+        ASSERT_HEAP(sizeof(header_used) == ALIGNMENT);
+        ASSERT_HEAP(sl_count() <= sizeof(sl_map[0]) * 8);
+        ASSERT_HEAP(mem.size() > sizeof(header_used) + min_block_size());
+        ASSERT_HEAP((mem.base() & (ALIGNMENT - 1)) == 0);
+        ASSERT_HEAP((mem.base() + mem.size()) > mem.base());
+
+        insert(new(reinterpret_cast<void *>(mem.base())) header_free(mem.size() - sizeof(header_used)));
+    }
+
+    void *alloc(size_t size)
+    {
+        if (size > mem.size()) {
+            return nullptr;
+        }
+
+        size = HEAP_MAX(size, ALIGNMENT);
+        size = align(size);
+
+        auto *block = find(size);
+
+        if (not block) {
+            return nullptr;
+        }
+
+        remove(block);
+
+        const size_t size_remaining {block->size() - size};
+
+        if (size_remaining >= sizeof(header_free) + sizeof(footer)) {
+            block->size(size);
+            insert(new (block->following_block(mem)) header_free(size_remaining - sizeof(header_used)));
+        }
+
+        auto *following = block->following_block(mem);
+        if (following) {
+            following->prev_free(false);
+        }
+
+        block->is_free(false);
+        return block->data_ptr();
+    }
+
+    void free(void *p)
+    {
+        if (not p) {
+            return;
+        }
+
+        header_free *block {reinterpret_cast<header_free *>(reinterpret_cast<char *>(p) - sizeof(header_used))};
+
+        if (not ptr_in_range(block)) {
+            return;
+        }
+
+        ASSERT_HEAP(block->canary_alive());
+        ASSERT_HEAP(not block->is_free());
+
+        auto *following = block->following_block(mem);
+
+        if (following and following->is_free()) {
+            remove(static_cast<header_free *>(following));
+            block->size(block->size() + following->size() + sizeof(header_used));
+        }
+
+        if (block->prev_free()) {
+            auto *preceding = static_cast<header_free *>(block->preceding_block(mem));
+
+            ASSERT_HEAP(preceding->is_free());
+            remove(preceding);
+            preceding->size(preceding->size() + block->size() + sizeof(header_used));
+            block = preceding;
+        }
+
+        insert(block);
+    }
+
+    // number of bytes usable at p, at least the size it was allocated with
+    size_t usable_size(void *p) const
+    {
+        const auto *header = reinterpret_cast<const header_used *>(reinterpret_cast<char *>(p) - sizeof(header_used));
+
+        ASSERT_HEAP(not header->is_free());
+        return header->size();
+    }
+
+    bool ptr_in_range(void *p) const
+    {
+        return reinterpret_cast<size_t>(p) >= mem.base() and reinterpret_cast<size_t>(p) < mem.end();
+    }
+
+    void check_integrity()
+    {
+        header_used* h {reinterpret_cast<header_used*>(mem.base())};
+        while (h) {
+            ASSERT_HEAP(h->canary_alive());
+            h = h->following_block(mem);
+        }
+    }
+
+    size_t num_blocks() const
+    {
+        size_t cnt {0};
+
+        for_each([&cnt](header_free *) { cnt++; });
+
+        return cnt;
+    }
+
+    size_t free_mem() const
+    {
+        size_t size {0};
+
+        for_each([&size](header_free *elem) { size += elem->size(); });
+
+        return size;
+    }
+
+    const STEPS &steps() const { return *this; }
+
+    constexpr size_t alignment() const { return ALIGNMENT; }
+
+private:
+    memory &mem;
+
+    size_t        fl_map {0};
+    uint32_t      sl_map[fl_count()] {};
+    header_free  *lists[fl_count()][sl_count()] {};
+};
@@ -0,0 +1,185 @@
+#include <heap.hpp>
+#include <growable_memory.hpp>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+// malloc replacement to be loaded with LD_PRELOAD
+//
+//     LD_PRELOAD=libfirst-fit-heap-preload.so PROGRAM
+//
+// All calls go to one heap on a large reserved address range, serialized by
+// a mutex that is held across fork so the child gets a consistent heap.
+
+#define HEAP_EXPORT extern "C" __attribute__((visibility("default")))
+
+namespace {
+
+using preload_heap = first_fit_heap<HEAP_MIN_ALIGNMENT, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED, first_fit, growable_memory>;
+
+constexpr size_t RESERVE        {1ul << 36};
+constexpr size_t INITIAL        {1ul << 20};
+constexpr size_t HUGE_THRESHOLD {1ul << 20};
+constexpr size_t TRIM_THRESHOLD {4ul << 20};
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Constructed on first use. Static constructors run too late, other
+// libraries allocate from theirs already.
+alignas(growable_memory) char memory_storage[sizeof(growable_memory)];
+alignas(preload_heap) char heap_storage[sizeof(preload_heap)];
+preload_heap *heap {nullptr};
+
+class locked_heap
+{
+public:
+    locked_heap()
+    {
+        pthread_mutex_lock(&lock);
+
+        if (not heap) {
+            auto *mem = new (memory_storage) growable_memory(RESERVE, INITIAL);
+
+            heap = new (heap_storage) preload_heap(*mem);
+            heap->huge_threshold(HUGE_THRESHOLD);
+            heap->trim_threshold(TRIM_THRESHOLD);
+        }
+    }
+
+    ~locked_heap() { pthread_mutex_unlock(&lock); }
+
+    preload_heap *operator->() { return heap; }
+};
+
+void *out_of_memory()
+{
+    errno = ENOMEM;
+    return nullptr;
+}
+
+bool valid_alignment(size_t alignment)
+{
+    return alignment and (alignment & (alignment - 1)) == 0;
+}
+
+void *alloc_aligned(size_t alignment, size_t size)
+{
+    void *p = locked_heap()->alloc_aligned(size, alignment);
+    return p ? p : out_of_memory();
+}
+
+void prepare_fork() { pthread_mutex_lock(&lock); }
+void after_fork()   { pthread_mutex_unlock(&lock); }
+
+// Registered outside of the lock, pthread_atfork may allocate itself.
+__attribute__((constructor)) void register_fork_handlers()
+{
+    locked_heap();
+    pthread_atfork(prepare_fork, after_fork, after_fork);
+}
+
+}
+
+HEAP_EXPORT void *malloc(size_t size)
+{
+    void *p = locked_heap()->alloc(size);
+    return p ? p : out_of_memory();
+}
+
+HEAP_EXPORT void free(void *p)
+{
+    if (p) {
+        locked_heap()->free(p);
+    }
+}
+
+HEAP_EXPORT void *calloc(size_t num, size_t size)
+{
+    if (size and num > ~0ul / size) {
+        return out_of_memory();
+    }
+
+    void *p = malloc(num * size);
+
+    if (p) {
+        memset(p, 0, num * size);
+    }
+
+    return p;
+}
+
+HEAP_EXPORT void *realloc(void *p, size_t size)
+{
+    if (p and not size) {
+        free(p);
+        return nullptr;
+    }
+
+    locked_heap heap;
+
+    // blocks of another allocator have no header to take the size from
+    if (p and not heap->ptr_in_range(p)) {
+        return out_of_memory();
+    }
+
+    void *moved = heap->realloc(p, size);
+    return moved ? moved : out_of_memory();
+}
+
+HEAP_EXPORT int posix_memalign(void **out, size_t alignment, size_t size)
+{
+    if (not valid_alignment(alignment) or alignment % sizeof(void *)) {
+        return EINVAL;
+    }
+
+    void *p = locked_heap()->alloc_aligned(size, alignment);
+
+    if (not p) {
+        return ENOMEM;
+    }
+
+    *out = p;
+    return 0;
+}
+
+HEAP_EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (not valid_alignment(alignment)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    return alloc_aligned(alignment, size);
+}
+
+// the obsolete variants, so no block of glibc ever reaches free
+HEAP_EXPORT void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+HEAP_EXPORT void *valloc(size_t size)
+{
+    return alloc_aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+HEAP_EXPORT void *pvalloc(size_t size)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+
+    if (size > ~0ul - page) {
+        return out_of_memory();
+    }
+
+    return alloc_aligned(page, size ? (size + page - 1) & ~(page - 1) : page);
+}
+
+HEAP_EXPORT size_t malloc_usable_size(void *p)
+{
+    if (not p) {
+        return 0;
+    }
+
+    locked_heap heap;
+    return heap->ptr_in_range(p) ? heap->usable_size(p) : 0;
+}
@@ -1,10 +1,47 @@
 #include "test.hpp"
 #include <heap.hpp>
+#include <tlsf_heap.hpp>
+#include <concurrent_heap.hpp>
+#include <arena_heap.hpp>
+#include <slab_allocator.hpp>
+#include <growable_memory.hpp>
+#include <heap_trace.hpp>
+#include <persistent_heap.hpp>
+#include <shared_heap.hpp>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <thread>
 #include <vector>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// before Linux 4.17 and glibc 2.28 the address is only a hint, callers
+// compare it with the result
+#ifndef MAP_FIXED_NOREPLACE
+    #define MAP_FIXED_NOREPLACE 0
+#endif
+
+// the adapters need std::pmr, which older standard libraries lack
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+    #include <heap_resource.hpp>
+    #define TEST_HEAP_RESOURCE
+#endif
+
 static constexpr size_t PAGE_SIZE {4096};
 
-template<size_t ALIGNMENT = 16>
+template<size_t ALIGNMENT = 16, unsigned MODE = HEAP_MODE_DEFAULT, class HEAP = first_fit_heap<ALIGNMENT, MODE>>
 class test_ctx
 {
 public:
@@ -26,7 +63,7 @@ private:
     char *ptr_align;
 public:
     fixed_memory mem;
-    first_fit_heap<ALIGNMENT> heap;
+    HEAP heap;
 
 };
 
@@ -43,13 +80,13 @@ static bool check_alignment()
     return ((addr & (alignment - 1)) == 0);
 }
 
-template<size_t ALIGNMENT, class ON_PTR_ALLOC_FN, class ON_PTR_FREE_FN>
+template<size_t ALIGNMENT, class ON_PTR_ALLOC_FN, class ON_PTR_FREE_FN, class CTX = test_ctx<>>
 bool generic_alloc_and_free(ON_PTR_ALLOC_FN ptr_alloc_fn,
                             ON_PTR_FREE_FN ptr_free_fn,
                             size_t alloc_size = ALIGNMENT
                             )
 {
-    test_ctx<> ctx(32 * PAGE_SIZE);
+    CTX ctx(32 * PAGE_SIZE);
 
     std::vector<void *> ptrs;
 
@@ -83,143 +120,2216 @@ bool generic_alloc_and_free(ON_PTR_ALLOC_FN ptr_alloc_fn,
     return TEST_SUCCESS;
 }
 
-TEST_SUITE_START
+template<unsigned MODE>
+static bool check_merging()
+{
+    __attribute__((aligned(HEAP_MIN_ALIGNMENT))) char buffer[1024];
 
-TEST(zero_alloc_should_not_return_nullptr,
+    fixed_memory mem(size_t(buffer), 1024);
+    first_fit_heap<HEAP_MIN_ALIGNMENT, MODE> heap(mem);
+
+    auto free_mem_begin {heap.free_mem()};
+
+    auto* p1 = heap.alloc(16);
+    auto* p2 = heap.alloc(100);
+    auto* p3 = heap.alloc(16);
+
+    heap.free(p2);
+    ASSERT(heap.num_blocks() == 2);
+
+    heap.free(p1);
+    ASSERT(heap.num_blocks() == 2);
+
+    heap.free(p3);
+    ASSERT(heap.num_blocks() == 1);
+
+    ASSERT(heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+}
+
+template<unsigned MODE>
+static bool check_realloc()
 {
-    test_ctx<> ctx(PAGE_SIZE);
+    __attribute__((aligned(HEAP_MIN_ALIGNMENT))) char buffer[4096];
 
-    void *ptr = ctx.alloc(0);
-    ASSERT(ptr != nullptr);
+    fixed_memory mem(size_t(buffer), sizeof(buffer));
+    first_fit_heap<HEAP_MIN_ALIGNMENT, MODE> heap(mem);
+
+    const auto free_mem_begin {heap.free_mem()};
+
+    auto filled = [](void *p, size_t size, char c) {
+        return std::all_of(static_cast<char *>(p), static_cast<char *>(p) + size, [c](char v) { return v == c; });
+    };
+
+    auto *a = heap.alloc(128);
+    auto *b = heap.alloc(128);
+    auto *c = heap.alloc(64);
+    auto *d = heap.alloc(64);
+    memset(a, 'a', 128);
+    memset(c, 'c', 64);
+
+    const auto blocks {heap.num_blocks()};
+    const auto free_mem {heap.free_mem()};
+
+    // tail too small for a block of its own
+    ASSERT(heap.realloc(a, 120) == a);
+    ASSERT(heap.usable_size(a) == 128);
+    ASSERT(heap.num_blocks() == blocks);
+
+    // shrink in front of a used block splits off a new free block, the
+    // smallest block size depends on the mode
+    ASSERT(heap.realloc(a, 16) == a);
+    const auto small {heap.usable_size(a)};
+    ASSERT(small < 128);
+    ASSERT(heap.num_blocks() == blocks + 1);
+    ASSERT(heap.free_mem() == free_mem + 128 - small - 16);
+    ASSERT(filled(a, 16, 'a'));
+
+    // grow into the whole following free block
+    ASSERT(heap.realloc(a, 128) == a);
+    ASSERT(heap.usable_size(a) == 128);
+    ASSERT(heap.num_blocks() == blocks);
+    ASSERT(heap.free_mem() == free_mem);
+    ASSERT(filled(a, 16, 'a'));
+    memset(a, 'a', 128);
+
+    // shrink in front of a free block merges the tail into it
+    heap.free(b);
+    ASSERT(heap.num_blocks() == blocks + 1);
+    ASSERT(heap.realloc(a, 16) == a);
+    ASSERT(heap.num_blocks() == blocks + 1);
+    ASSERT(heap.free_mem() == free_mem + 128 + 128 - small);
+
+    // grow into a part of the following free block
+    ASSERT(heap.realloc(a, 64) == a);
+    ASSERT(heap.usable_size(a) == 64);
+    ASSERT(heap.num_blocks() == blocks + 1);
+    ASSERT(heap.free_mem() == free_mem + 128 + 128 - 64);
+    ASSERT(filled(a, 16, 'a'));
+    memset(a, 'a', 64);
+
+    // the following free block is too small, the data moves
+    auto *moved = heap.realloc(a, 1024);
+    ASSERT(moved != nullptr and moved != a);
+    ASSERT(filled(moved, 64, 'a'));
+    a = moved;
+
+    // the following block is used, the data moves
+    moved = heap.realloc(c, 128);
+    ASSERT(moved != nullptr and moved != c);
+    ASSERT(filled(moved, 64, 'c'));
+    c = moved;
+
+    // a failing realloc leaves the block alone
+    ASSERT(heap.realloc(c, sizeof(buffer)) == nullptr);
+    ASSERT(filled(c, 64, 'c'));
+
+    auto *e = heap.realloc(nullptr, 32);
+    ASSERT(e != nullptr);
+
+    heap.check_integrity();
+
+    heap.free(a);
+    heap.free(c);
+    heap.free(d);
+    heap.free(e);
+
+    ASSERT(heap.num_blocks() == 1);
+    ASSERT(heap.free_mem() == free_mem_begin);
 
     return TEST_SUCCESS;
-});
+}
 
-TEST(simple_alloc_and_free,
+template<unsigned MODE>
+static bool check_alloc_aligned()
 {
-    test_ctx<> ctx(PAGE_SIZE);
+    test_ctx<16, MODE> ctx(256 * PAGE_SIZE);
+    const auto free_mem_begin {ctx.heap.free_mem()};
+    std::vector<void *> ptrs;
+
+    for (size_t alignment = 16; alignment <= 4 * PAGE_SIZE; alignment *= 2) {
+        // a small block in front moves the next free block off the alignment
+        ptrs.push_back(ctx.alloc(24));
+
+        void *p = ctx.heap.alloc_aligned(100, alignment);
+        ASSERT(p != nullptr);
+        ASSERT((reinterpret_cast<size_t>(p) & (alignment - 1)) == 0);
+        ASSERT(ctx.heap.usable_size(p) >= 100);
+        memset(p, 0xab, 100);
+        ptrs.push_back(p);
+    }
+
+    ctx.heap.check_integrity();
+
+    // the leading slack of the large alignments stayed in the free lists
+    ASSERT(ctx.heap.num_blocks() > 1);
+
+    for (auto *p : ptrs) {
+        ctx.free(p);
+    }
 
-    ctx.free(ctx.alloc(10));
     ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
 
     return TEST_SUCCESS;
-});
+}
 
-TEST(heap_alignment,
+template<unsigned MODE>
+static bool check_growth()
 {
-    ASSERT(check_alignment<test_ctx<16>>());
-    ASSERT(check_alignment<test_ctx<32>>());
-    ASSERT(check_alignment<test_ctx<64>>());
-    ASSERT(check_alignment<test_ctx<128>>());
-    ASSERT(check_alignment<test_ctx<256>>());
-    ASSERT(check_alignment<test_ctx<1024>>());
+    growable_memory mem(64 << 20, PAGE_SIZE);
+    first_fit_heap<HEAP_MIN_ALIGNMENT, MODE> heap(mem);
+    std::vector<void *> ptrs;
+
+    ASSERT(mem.size() == PAGE_SIZE);
+
+    // far more than fits into the initial page, including blocks larger
+    // than a commit step
+    for (size_t i = 0; i < 2048; i++) {
+        const size_t size {i % 256 == 0 ? 256ul << 10 : 1000ul};
+        void *p = heap.alloc(size);
+
+        ASSERT(p != nullptr);
+        memset(p, 0x5a, size);
+        ptrs.push_back(p);
+    }
+
+    void *aligned = heap.alloc_aligned(100, 1 << 20);
+    ASSERT(aligned != nullptr);
+    ASSERT((reinterpret_cast<size_t>(aligned) & ((1 << 20) - 1)) == 0);
+    ptrs.push_back(aligned);
+
+    // alignments the heap has anyway grow the memory just like alloc
+    for (size_t i = 0; i < 8; i++) {
+        void *p = heap.alloc_aligned(900000, i % 2 ? 8 : HEAP_MIN_ALIGNMENT);
+
+        ASSERT(p != nullptr);
+        ptrs.push_back(p);
+    }
+
+    ASSERT(mem.size() > 4 << 20);
+    heap.check_integrity();
+
+    // many holes in front of the free tail, growing extends the tail
+    // instead of adding a block of its own
+    for (size_t i = 1; i < 2048; i += 2) {
+        heap.free(ptrs[i]);
+        ptrs[i] = nullptr;
+    }
+
+    heap.check_integrity();
+
+    const size_t holes {heap.num_blocks()};
+    const size_t grown {mem.size()};
+    void *big = heap.alloc(2 << 20);
+
+    ASSERT(big != nullptr);
+    ASSERT(mem.size() > grown);
+    ASSERT(heap.num_blocks() == holes);
+    heap.check_integrity();
+    ptrs.push_back(big);
+
+    for (auto *p : ptrs) {
+        heap.free(p);
+    }
+
+    // all grown tails merged into one block again
+    ASSERT(heap.num_blocks() == 1);
+    ASSERT(heap.free_mem() == mem.size() - (MODE & HEAP_MODE_COMPACT ? 24 : 16));
+
+    // the reservation is the limit
+    ASSERT(heap.alloc(128 << 20) == nullptr);
+    ASSERT(heap.alloc(32 << 20) != nullptr);
+
     return TEST_SUCCESS;
-});
+}
 
-TEST(linear_alloc_and_free,
+template<unsigned MODE, class FIT = first_fit>
+static bool check_batch()
 {
-    auto after_alloc = [](void *p, size_t size) {
-        memset(p, 0xf, size);
-        return TEST_SUCCESS;
+    test_ctx<16, MODE, first_fit_heap<16, MODE, FIT>> ctx(64 * 1024);
+    const auto free_mem_begin {ctx.heap.free_mem()};
+    std::mt19937 rng(7);
+    void *ptrs[64];
+    const size_t header {MODE & HEAP_MODE_COMPACT ? 8ul : 16ul};
+
+    // one free block holds the whole batch, the blocks follow each other
+    ASSERT(ctx.heap.alloc_n(100, 64, ptrs) == 64);
+    ASSERT(ctx.heap.num_blocks() == 1);
+
+    for (size_t i = 0; i < 64; i++) {
+        ASSERT(ctx.heap.usable_size(ptrs[i]) >= 100);
+        ASSERT(i == 0 or static_cast<char *>(ptrs[i]) == static_cast<char *>(ptrs[i - 1]) + ctx.heap.usable_size(ptrs[i - 1]) + header);
+        memset(ptrs[i], 0x5a, 100);
+    }
+
+    ctx.heap.check_integrity();
+
+    // free in two scrambled halves, the second one fills the gaps
+    std::shuffle(std::begin(ptrs), std::end(ptrs), rng);
+    ctx.heap.free_n(ptrs, 32);
+    ctx.heap.check_integrity();
+    ctx.heap.free_n(ptrs + 32, 32);
+
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    // a fragmented heap serves the batch from several blocks
+    std::vector<void *> holes(16);
+    for (auto *&p : holes) {
+        p = ctx.alloc(1000);
+    }
+    for (size_t i = 0; i < holes.size(); i += 2) {
+        ctx.free(holes[i]);
+        holes[i] = nullptr;
+    }
+
+    std::vector<void *> batch(1000);
+    const size_t n {ctx.heap.alloc_n(1000, batch.size(), batch.data())};
+    ASSERT(n > 8 and n < batch.size());
+    ctx.heap.check_integrity();
+
+    // null pointers are skipped like in free
+    batch.insert(batch.begin() + n, holes.begin(), holes.end());
+    ctx.heap.free_n(batch.data(), n + holes.size());
+
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+}
+
+template<unsigned MODE>
+static bool check_deferred()
+{
+    test_ctx<16, MODE | HEAP_MODE_DEFERRED> ctx(64 * PAGE_SIZE);
+    const auto free_mem_begin {ctx.heap.free_mem()};
+    const size_t header {MODE & HEAP_MODE_COMPACT ? 8ul : 16ul};
+    std::vector<void *> ptrs;
+
+    for (size_t i = 0; i < 64; i++) {
+        ptrs.push_back(ctx.alloc(16 + i % 8 * 16));
+        memset(ptrs.back(), 0x5a, 16 + i % 8 * 16);
+    }
+
+    // freed blocks wait in the quick lists without being merged
+    for (auto *p : ptrs) {
+        ctx.free(p);
+    }
+
+    ASSERT(ctx.heap.num_blocks() == 65);
+    ASSERT(ctx.heap.stats().deferred_blocks == 64);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin - 64 * header);
+    ctx.heap.check_integrity();
+
+    // the same size comes back from its list, last in first out
+    ASSERT(ctx.alloc(128) == ptrs[63]);
+    ASSERT(ctx.alloc(128) == ptrs[55]);
+    ASSERT(ctx.heap.stats().deferred_blocks == 62);
+    ctx.free(ptrs[55]);
+    ctx.free(ptrs[63]);
+
+    // an alloc no free block can serve merges them first
+    void *large = ctx.alloc(free_mem_begin - 1024);
+    ASSERT(large != nullptr);
+    ASSERT(ctx.heap.stats().deferred_blocks == 0);
+    ctx.heap.check_integrity();
+
+    ctx.free(large);
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    // free merges all of them when they would exceed the limit
+    ctx.heap.deferred_limit(1024);
+
+    for (auto *&p : ptrs) {
+        p = ctx.alloc(64);
+    }
+    for (auto *p : ptrs) {
+        ctx.free(p);
+        ASSERT(ctx.heap.stats().deferred_bytes <= 1024);
+    }
+
+    ASSERT(ctx.heap.stats().deferred_blocks < 64);
+    ctx.heap.check_integrity();
+
+    ctx.heap.consolidate();
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+}
+
+// Build a list in a persistent heap, reopen it at another address and take
+// it apart again
+template<unsigned MODE>
+static bool check_persistent()
+{
+    struct node
+    {
+        size_t next;
+        size_t value;
     };
 
-    auto before_free = [](void *p, size_t size) {
-        char *ptr = reinterpret_cast<char *>(p);
-        for (size_t i = 0; i < size; i++) {
-            if (ptr[i] != 0xf) {
-                TRACE("pointer mismatch at %zd: %c vs %c", i, ptr[i], 0xf);
-                return TEST_FAILED;
+    static constexpr size_t SIZE {64 * PAGE_SIZE};
+
+    char path[] {"/tmp/first-fit-heap-persistent-XXXXXX"};
+    close(mkstemp(path));
+
+    size_t old_base, free_mem_begin, free_mem, blocks;
+
+    {
+        persistent_heap<16, MODE> heap(path, SIZE);
+        ASSERT(heap.valid() and heap.created());
+
+        free_mem_begin = heap.heap().free_mem();
+        old_base       = reinterpret_cast<size_t>(heap.at(0));
+
+        node *head {nullptr};
+        for (size_t i = 1; i <= 301; i++) {
+            auto *n = static_cast<node *>(heap.alloc(sizeof(node) + i % 5 * 24));
+
+            n->next  = head ? heap.offset_of(head) : 0;
+            n->value = i;
+            head     = n;
+        }
+
+        // fragment the heap, every third node is taken out again
+        for (auto *n = head; n->next;) {
+            auto *next = static_cast<node *>(heap.at(n->next));
+
+            if (next->value % 3 == 0) {
+                n->next = next->next;
+                heap.free(next);
+            } else {
+                n = next;
             }
         }
 
-        return TEST_SUCCESS;
-    };
+        heap.root(head);
+        free_mem = heap.heap().free_mem();
+        blocks   = heap.heap().num_blocks();
+        ASSERT(blocks > 1);
+    }
 
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free));
-    ASSERT(generic_alloc_and_free<32>(after_alloc, before_free));
-    ASSERT(generic_alloc_and_free<64>(after_alloc, before_free));
-    ASSERT(generic_alloc_and_free<256>(after_alloc, before_free));
-    ASSERT(generic_alloc_and_free<1024>(after_alloc, before_free));
-    ASSERT(generic_alloc_and_free<2048>(after_alloc, before_free));
-    ASSERT(generic_alloc_and_free<4096>(after_alloc, before_free));
+    // keep the old address taken, the file has to be mapped elsewhere
+    void *blocker = mmap(reinterpret_cast<void *>(old_base), PAGE_SIZE, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    ASSERT(blocker != MAP_FAILED);
 
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 32));
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 64));
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 128));
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 256));
+    {
+        persistent_heap<16, MODE> heap(path, SIZE);
+        ASSERT(heap.valid() and not heap.created());
+        ASSERT(reinterpret_cast<size_t>(heap.at(0)) != old_base);
+        ASSERT(heap.heap().free_mem() == free_mem);
+        ASSERT(heap.heap().num_blocks() == blocks);
+        heap.heap().check_integrity();
 
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 31));
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 60));
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 129));
-    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 277));
+        // a second opener finds the file in use
+        ASSERT(not (persistent_heap<16, MODE>(path, SIZE).valid()));
+
+        // the values counting down without the multiples of three
+        size_t expected {301}, nodes {0};
+        for (auto *n = static_cast<node *>(heap.root()); n; nodes++) {
+            ASSERT(n->value == expected);
+            expected -= expected % 3 == 1 ? 2 : 1;
+
+            auto *next = n->next ? static_cast<node *>(heap.at(n->next)) : nullptr;
+            heap.free(n);
+            n = next;
+        }
+
+        ASSERT(nodes == 201);
+        heap.root(nullptr);
+        heap.heap().consolidate();
+        ASSERT(heap.heap().num_blocks() == 1);
+        ASSERT(heap.heap().free_mem() == free_mem_begin);
+    }
+
+    munmap(blocker, PAGE_SIZE);
+
+    // a heap of another type does not open the file
+    ASSERT(not (persistent_heap<32, MODE>(path, SIZE).valid()));
+    ASSERT(not (persistent_heap<16, MODE ^ HEAP_MODE_DOUBLY_LINKED>(path, SIZE).valid()));
 
+    // neither do damaged blocks
+    {
+        persistent_heap<16, MODE> heap(path, SIZE);
+        ASSERT(heap.valid() and heap.root() == nullptr);
+
+        // an overflow into the header of the following block
+        auto *p = static_cast<char *>(heap.alloc(100));
+        memset(p, 0, heap.usable_size(p) + 16);
+        heap.root(p);
+    }
+
+    ASSERT(not (persistent_heap<16, MODE>(path, SIZE).valid()));
+
+    unlink(path);
     return TEST_SUCCESS;
-});
+}
 
-TEST(heap_has_valid_default_alignment,
+// A block written by a shared heap worker, filled with the worker's number
+struct shared_block
 {
-    __attribute__((aligned(HEAP_MIN_ALIGNMENT))) char buffer[1024];
+    size_t worker;
+    size_t size;
 
-    fixed_memory mem(size_t(buffer), 1024);
-    first_fit_heap<> heap(mem);
-    ASSERT(heap.alignment() == HEAP_MIN_ALIGNMENT);
-    return TEST_SUCCESS;
-});
+    void fill(size_t worker_, size_t size_)
+    {
+        worker = worker_;
+        size   = size_;
+        memset(this + 1, static_cast<int>(worker), size - sizeof(*this));
+    }
 
-TEST(integrity_check,
+    bool intact() const
+    {
+        auto *bytes = reinterpret_cast<const unsigned char *>(this + 1);
+        return std::all_of(bytes, bytes + size - sizeof(*this), [this](unsigned char b) { return b == worker; });
+    }
+};
+
+// Body of a process working on the shared heap in fd next to the others.
+// It allocates and frees at random and sends every 16th block to out as
+// an offset for the receiver to read and free.
+static bool shared_heap_worker(int fd, size_t worker, int out)
 {
-    __attribute__((aligned(HEAP_MIN_ALIGNMENT))) char buffer[1024];
+    shared_heap<> heap(fd);
+    ASSERT(heap.valid());
 
-    fixed_memory mem(size_t(buffer), 1024);
-    first_fit_heap<> heap(mem);
+    std::mt19937 rng(worker);
+    std::vector<shared_block *> blocks;
 
-    HEAP_UNUSED auto* p1 = heap.alloc(16);
-    auto* p2 = heap.alloc(16);
-    HEAP_UNUSED auto* p3 = heap.alloc(16);
-    auto* p4 = heap.alloc(16);
-    HEAP_UNUSED auto* p5 = heap.alloc(16);
-    *((char*)p3 - 8) = 5;
+    for (size_t round = 0; round < 3000; round++) {
+        const size_t size {sizeof(shared_block) + rng() % 500};
+        auto *b = static_cast<shared_block *>(heap.alloc(size));
 
-    heap.free(p2);
-    heap.free(p4);
+        if (b) {
+            b->fill(worker, size);
 
-    try {
-        heap.check_integrity();
-    } catch (std::exception&) {
-        return TEST_SUCCESS;
+            if (round % 16 == 0) {
+                const size_t offset {heap.offset_of(b)};
+                ASSERT(write(out, &offset, sizeof(offset)) == sizeof(offset));
+            } else {
+                blocks.push_back(b);
+            }
+        }
+
+        if (not blocks.empty() and rng() % 2) {
+            const size_t i {rng() % blocks.size()};
+            auto *victim = blocks[i];
+
+            ASSERT(victim->intact() and victim->worker == worker);
+            blocks[i] = blocks.back();
+            blocks.pop_back();
+            heap.free(victim);
+        }
     }
-    return TEST_FAILED;
-});
 
-TEST(merging_works_without_losing_memory,
-{
-    __attribute__((aligned(HEAP_MIN_ALIGNMENT))) char buffer[1024];
+    for (auto *b : blocks) {
+        ASSERT(b->intact());
+        heap.free(b);
+    }
 
-    fixed_memory mem(size_t(buffer), 1024);
-    first_fit_heap<> heap(mem);
+    return heap.verify();
+}
 
-    auto free_mem_begin {heap.free_mem()};
-    ASSERT(heap.num_blocks() == 1);
+// Heap bytes a slab pool takes for many objects of SIZE bytes stay within a
+// quarter above the object bytes, slabs cut ahead in a chunk included.
+template <size_t SIZE>
+static bool check_slab_overhead()
+{
+    static constexpr size_t OBJECTS {4096};
 
-    auto* p1 = heap.alloc(16);
-    auto* p2 = heap.alloc(16);
-    auto* p3 = heap.alloc(16);
+    test_ctx<> ctx(1024 * PAGE_SIZE);
+    const size_t free_mem_begin {ctx.heap.free_mem()};
 
-    ASSERT(heap.num_blocks() == 1);
+    {
+        slab_pool<SIZE, first_fit_heap<>> pool(ctx.heap);
+        std::vector<void *> objects;
 
-    heap.free(p2);
-    ASSERT(heap.num_blocks() == 2);
+        for (size_t i = 0; i < OBJECTS; i++) {
+            void *p = pool.alloc();
+            ASSERT(p != nullptr);
+            objects.push_back(p);
+        }
 
-    heap.free(p1);
-    ASSERT(heap.num_blocks() == 2);
+        const size_t used {free_mem_begin - ctx.heap.free_mem()};
+        ASSERT(used * 4 <= OBJECTS * SIZE * 5);
 
-    heap.free(p3);
-    ASSERT(heap.num_blocks() == 1);
+        for (void *p : objects) {
+            pool.free(p);
+        }
+    }
 
-    ASSERT(heap.free_mem() == free_mem_begin);
+    ctx.heap.check_integrity();
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
 
     return TEST_SUCCESS;
-});
+}
+
+// huge blocks keep the heap's alignment with every header layout
+template <size_t ALIGNMENT, unsigned MODE>
+static bool check_huge_alignment()
+{
+    growable_memory mem(16 << 20, 1 << 20);
+    first_fit_heap<ALIGNMENT, MODE> heap(mem);
 
+    heap.huge_threshold(64 << 10);
+
+    for (size_t size : {64ul << 10, (1ul << 20) + 8, 3ul << 20}) {
+        void *p = heap.alloc(size);
+
+        ASSERT(p != nullptr and heap.mapped_mem() != 0);
+        ASSERT((reinterpret_cast<size_t>(p) & (ALIGNMENT - 1)) == 0);
+        ASSERT(heap.usable_size(p) >= size);
+
+        memset(p, 0x22, size);
+        heap.free(p);
+    }
+
+    ASSERT(heap.mapped_mem() == 0);
+    return TEST_SUCCESS;
+}
+
+// Heap on a static_memory at BASE, which is mapped first. Does nothing if
+// the address range is not available, mapped tells whether it was.
+template <size_t BASE>
+static bool check_static_memory(bool &mapped)
+{
+    static constexpr size_t size {1ul << 20};
+    using static_heap = first_fit_heap<HEAP_MIN_ALIGNMENT, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED, first_fit, static_memory<BASE, size>>;
+
+    void *region = mmap(reinterpret_cast<void *>(BASE), size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (region != reinterpret_cast<void *>(BASE)) {
+        if (region != MAP_FAILED) {
+            munmap(region, size);
+        }
+
+        return TEST_SUCCESS;
+    }
+
+    mapped = true;
+
+    static_memory<BASE, size> mem;
+    static_heap heap(mem);
+    const auto free_mem_begin {heap.free_mem()};
+    std::vector<void *> ptrs;
+    std::mt19937 rng(3);
+
+    for (size_t i = 0; i < 1000; i++) {
+        void *p = heap.alloc(16 + rng() % 512);
+        ASSERT(p != nullptr and heap.ptr_in_range(p));
+        ptrs.push_back(p);
+    }
+
+    std::shuffle(ptrs.begin(), ptrs.end(), rng);
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        heap.free(ptrs[i]);
+    }
+    heap.check_integrity();
+
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        heap.free(ptrs[i]);
+    }
+
+    ASSERT(heap.num_blocks() == 1);
+    ASSERT(heap.free_mem() == free_mem_begin);
+    ASSERT(heap.free_mem() == size - 16);
+
+    munmap(region, size);
+    return TEST_SUCCESS;
+}
+
+// number of resident pages overlapping [p, p + size)
+static size_t resident_pages(void *p, size_t size)
+{
+    const size_t start {reinterpret_cast<size_t>(p) & ~(PAGE_SIZE - 1)};
+    const size_t stop  {(reinterpret_cast<size_t>(p) + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)};
+
+    std::vector<unsigned char> vec((stop - start) / PAGE_SIZE);
+    mincore(reinterpret_cast<void *>(start), stop - start, vec.data());
+    return std::count_if(vec.begin(), vec.end(), [](unsigned char v) { return v & 1; });
+}
+
+struct count_steps
+{
+    size_t steps {0};
+
+    void step() { steps++; }
+};
+
+// Largest number of list and bitmap operations a single alloc or free took
+// on a tlsf heap that got fragmented into the given number of free blocks.
+static size_t tlsf_worst_case_steps(size_t fragments)
+{
+    test_ctx<16, HEAP_MODE_DEFAULT, tlsf_heap<16, count_steps>> ctx((fragments * 2 + 64) * 160);
+    auto &heap = ctx.heap;
+
+    std::vector<void *> ptrs;
+    for (size_t i = 0; i < fragments * 2; i++) {
+        ptrs.push_back(heap.alloc(16 + (i % 8) * 16));
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        heap.free(ptrs[i]);
+    }
+
+    size_t worst {0};
+    auto measure = [&heap, &worst](auto fn) {
+        const size_t before {heap.steps().steps};
+        fn();
+        worst = std::max(worst, heap.steps().steps - before);
+    };
+
+    for (size_t size = 16; size <= 1024; size += 48) {
+        void *p {nullptr};
+        measure([&] { p = heap.alloc(size); });
+        measure([&] { heap.free(p); });
+    }
+
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        measure([&] { heap.free(ptrs[i]); });
+    }
+
+    return heap.num_blocks() == 1 ? worst : ~0ul;
+}
+
+// Allocates blocks of the given sizes, each followed by a small used block,
+// and frees them again, which leaves holes of exactly these sizes.
+template<class CTX>
+static std::vector<void *> make_holes(CTX &ctx, std::initializer_list<size_t> sizes)
+{
+    std::vector<void *> holes;
+
+    for (auto size : sizes) {
+        holes.push_back(ctx.alloc(size));
+        ctx.alloc(16);
+    }
+
+    for (auto *p : holes) {
+        ctx.free(p);
+    }
+
+    return holes;
+}
+
+template<class FIT>
+using fit_ctx = test_ctx<16, HEAP_MODE_DEFAULT, first_fit_heap<16, HEAP_MODE_DEFAULT, FIT>>;
+
+// std::mutex that counts how often it was taken
+struct counting_lock
+{
+    void lock()
+    {
+        taken++;
+        m.lock();
+    }
+
+    void unlock() { m.unlock(); }
+
+    static std::atomic<size_t> taken;
+    std::mutex m;
+};
+
+std::atomic<size_t> counting_lock::taken {0};
+
+TEST_SUITE_START
+
+TEST(zero_alloc_should_not_return_nullptr,
+{
+    test_ctx<> ctx(PAGE_SIZE);
+
+    void *ptr = ctx.alloc(0);
+    ASSERT(ptr != nullptr);
+
+    return TEST_SUCCESS;
+});
+
+TEST(simple_alloc_and_free,
+{
+    test_ctx<> ctx(PAGE_SIZE);
+
+    ctx.free(ctx.alloc(10));
+    ASSERT(ctx.heap.num_blocks() == 1);
+
+    return TEST_SUCCESS;
+});
+
+TEST(heap_alignment,
+{
+    ASSERT(check_alignment<test_ctx<16>>());
+    ASSERT(check_alignment<test_ctx<32>>());
+    ASSERT(check_alignment<test_ctx<64>>());
+    ASSERT(check_alignment<test_ctx<128>>());
+    ASSERT(check_alignment<test_ctx<256>>());
+    ASSERT(check_alignment<test_ctx<1024>>());
+    return TEST_SUCCESS;
+});
+
+TEST(linear_alloc_and_free,
+{
+    auto after_alloc = [](void *p, size_t size) {
+        memset(p, 0xf, size);
+        return TEST_SUCCESS;
+    };
+
+    auto before_free = [](void *p, size_t size) {
+        char *ptr = reinterpret_cast<char *>(p);
+        for (size_t i = 0; i < size; i++) {
+            if (ptr[i] != 0xf) {
+                TRACE("pointer mismatch at %zd: %c vs %c", i, ptr[i], 0xf);
+                return TEST_FAILED;
+            }
+        }
+
+        return TEST_SUCCESS;
+    };
+
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free));
+    ASSERT(generic_alloc_and_free<32>(after_alloc, before_free));
+    ASSERT(generic_alloc_and_free<64>(after_alloc, before_free));
+    ASSERT(generic_alloc_and_free<256>(after_alloc, before_free));
+    ASSERT(generic_alloc_and_free<1024>(after_alloc, before_free));
+    ASSERT(generic_alloc_and_free<2048>(after_alloc, before_free));
+    ASSERT(generic_alloc_and_free<4096>(after_alloc, before_free));
+
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 32));
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 64));
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 128));
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 256));
+
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 31));
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 60));
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 129));
+    ASSERT(generic_alloc_and_free<16>(after_alloc, before_free, 277));
+
+    return TEST_SUCCESS;
+});
+
+TEST(binned_linear_alloc_and_free,
+{
+    auto nop = [](void *, size_t) { return TEST_SUCCESS; };
+
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), test_ctx<16, HEAP_MODE_BINNED>>(nop, nop)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), test_ctx<16, HEAP_MODE_BINNED>>(nop, nop, 60)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), test_ctx<16, HEAP_MODE_BINNED>>(nop, nop, 277)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), test_ctx<16, HEAP_MODE_BINNED>>(nop, nop, 4096)));
+
+    return TEST_SUCCESS;
+});
+
+TEST(binned_alloc_picks_fitting_bin,
+{
+    test_ctx<16, HEAP_MODE_BINNED> ctx(PAGE_SIZE);
+    const size_t free_mem_begin {ctx.heap.free_mem()};
+
+    // fragment the heap into free blocks of different size classes
+    std::vector<void *> small, large;
+    for (unsigned i = 0; i < 8; i++) {
+        small.push_back(ctx.alloc(32));
+        large.push_back(ctx.alloc(256));
+    }
+
+    for (auto *p : large) {
+        ctx.free(p);
+    }
+    ASSERT(ctx.heap.num_blocks() == 8);
+
+    // a request larger than the 32 byte holes must skip them
+    void *p = ctx.alloc(256);
+    ASSERT(p == large.front());
+    ASSERT(ctx.heap.num_blocks() == 7);
+
+    void *q = ctx.alloc(100);
+    ASSERT(q != nullptr);
+    ASSERT(std::find(small.begin(), small.end(), q) == small.end());
+
+    ctx.free(p);
+    ctx.free(q);
+    for (auto *q : small) {
+        ctx.free(q);
+    }
+
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+    ctx.heap.check_integrity();
+
+    return TEST_SUCCESS;
+});
+
+TEST(heap_has_valid_default_alignment,
+{
+    __attribute__((aligned(HEAP_MIN_ALIGNMENT))) char buffer[1024];
+
+    fixed_memory mem(size_t(buffer), 1024);
+    first_fit_heap<> heap(mem);
+    ASSERT(heap.alignment() == HEAP_MIN_ALIGNMENT);
+    return TEST_SUCCESS;
+});
+
+TEST(integrity_check,
+{
+    __attribute__((aligned(HEAP_MIN_ALIGNMENT))) char buffer[1024];
+
+    fixed_memory mem(size_t(buffer), 1024);
+    first_fit_heap<> heap(mem);
+
+    HEAP_UNUSED auto* p1 = heap.alloc(16);
+    auto* p2 = heap.alloc(16);
+    HEAP_UNUSED auto* p3 = heap.alloc(16);
+    auto* p4 = heap.alloc(16);
+    HEAP_UNUSED auto* p5 = heap.alloc(16);
+    *((char*)p3 - 8) = 5;
+
+    heap.free(p2);
+    heap.free(p4);
+
+    try {
+        heap.check_integrity();
+    } catch (std::exception&) {
+        return TEST_SUCCESS;
+    }
+    return TEST_FAILED;
+});
+
+TEST(merging_works_without_losing_memory,
+{
+    __attribute__((aligned(HEAP_MIN_ALIGNMENT))) char buffer[1024];
+
+    fixed_memory mem(size_t(buffer), 1024);
+    first_fit_heap<> heap(mem);
+
+    auto free_mem_begin {heap.free_mem()};
+    ASSERT(heap.num_blocks() == 1);
+
+    auto* p1 = heap.alloc(16);
+    auto* p2 = heap.alloc(16);
+    auto* p3 = heap.alloc(16);
+
+    ASSERT(heap.num_blocks() == 1);
+
+    heap.free(p2);
+    ASSERT(heap.num_blocks() == 2);
+
+    heap.free(p1);
+    ASSERT(heap.num_blocks() == 2);
+
+    heap.free(p3);
+    ASSERT(heap.num_blocks() == 1);
+
+    ASSERT(heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+
+TEST(modes_merge_without_losing_memory,
+{
+    ASSERT(check_merging<HEAP_MODE_BINNED>());
+    ASSERT(check_merging<HEAP_MODE_DOUBLY_LINKED>());
+    ASSERT((check_merging<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>()));
+    ASSERT(check_merging<HEAP_MODE_COMPACT>());
+    ASSERT((check_merging<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED | HEAP_MODE_COMPACT>()));
+
+    return TEST_SUCCESS;
+});
+
+TEST(doubly_linked_linear_alloc_and_free,
+{
+    auto nop = [](void *, size_t) { return TEST_SUCCESS; };
+    using linked = test_ctx<16, HEAP_MODE_DOUBLY_LINKED>;
+    using both   = test_ctx<16, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>;
+
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), linked>(nop, nop)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), linked>(nop, nop, 60)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), linked>(nop, nop, 277)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), both>(nop, nop, 16)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), both>(nop, nop, 277)));
+
+    return TEST_SUCCESS;
+});
+
+TEST(doubly_linked_free_reuses_last_freed_block,
+{
+    test_ctx<16, HEAP_MODE_DOUBLY_LINKED> ctx(PAGE_SIZE);
+    const size_t free_mem_begin {ctx.heap.free_mem()};
+
+    std::vector<void *> ptrs;
+    for (unsigned i = 0; i < 16; i++) {
+        ptrs.push_back(ctx.alloc(64));
+    }
+
+    // free every other block, the list is LIFO so the last hole comes first
+    for (unsigned i = 0; i < ptrs.size(); i += 2) {
+        ctx.free(ptrs[i]);
+    }
+    ASSERT(ctx.heap.num_blocks() == 9);
+
+    void *p = ctx.alloc(64);
+    ASSERT(p == ptrs[14]);
+    ctx.free(p);
+
+    for (unsigned i = 1; i < ptrs.size(); i += 2) {
+        ctx.free(ptrs[i]);
+    }
+
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+    ctx.heap.check_integrity();
+
+    return TEST_SUCCESS;
+});
+
+TEST(tlsf_alloc_and_free,
+{
+    test_ctx<16, HEAP_MODE_DEFAULT, tlsf_heap<>> ctx(32 * PAGE_SIZE);
+    auto &heap = ctx.heap;
+
+    const size_t free_mem_begin {heap.free_mem()};
+
+    for (size_t alloc_size : {0ul, 16ul, 31ul, 277ul, 4096ul}) {
+        std::vector<void *> ptrs;
+        void *p {nullptr};
+
+        while ((p = heap.alloc(alloc_size))) {
+            ASSERT((reinterpret_cast<size_t>(p) & (heap.alignment() - 1)) == 0);
+            memset(p, 0xf, alloc_size);
+            ptrs.push_back(p);
+        }
+
+        ASSERT(heap.num_blocks() <= 1);
+
+        for (auto *q : ptrs) {
+            heap.free(q);
+        }
+
+        ASSERT(heap.num_blocks() == 1);
+        ASSERT(heap.free_mem() == free_mem_begin);
+    }
+
+    heap.check_integrity();
+
+    return TEST_SUCCESS;
+});
+
+TEST(tlsf_step_count_is_bounded,
+{
+    // alloc: find, remove and insert the remainder
+    // free:  remove both neighbours and insert the merged block
+    static constexpr size_t MAX_STEPS {3};
+
+    for (size_t fragments : {16ul, 256ul, 4096ul}) {
+        const size_t steps {tlsf_worst_case_steps(fragments)};
+        TRACE("fragments: %zu worst case steps: %zu", fragments, steps);
+        ASSERT(steps <= MAX_STEPS);
+    }
+
+    return TEST_SUCCESS;
+});
+
+TEST(fit_policies_select_expected_hole,
+{
+    {
+        fit_ctx<first_fit> ctx(PAGE_SIZE);
+        auto holes = make_holes(ctx, {128, 96, 64});
+        ASSERT(ctx.alloc(64) == holes[0]);
+    }
+
+    {
+        fit_ctx<best_fit> ctx(PAGE_SIZE);
+        auto holes = make_holes(ctx, {128, 96, 64});
+        ASSERT(ctx.alloc(64) == holes[2]);
+        ASSERT(ctx.alloc(80) == holes[1]);
+    }
+
+    {
+        fit_ctx<good_fit<1>> ctx(PAGE_SIZE);
+        auto holes = make_holes(ctx, {128, 96, 64});
+        ASSERT(ctx.alloc(64) == holes[1]);
+    }
+
+    {
+        fit_ctx<next_fit> ctx(PAGE_SIZE);
+        auto holes = make_holes(ctx, {64, 64, 64});
+
+        // the last search ended behind the holes, take the tail first
+        const size_t tail {ctx.heap.free_mem() - 3 * 64};
+        ASSERT(ctx.alloc(tail) > holes[2]);
+
+        // wrap around and walk through the holes
+        ASSERT(ctx.alloc(64) == holes[0]);
+        ctx.free(holes[0]);
+        ASSERT(ctx.alloc(64) == holes[1]);
+        ASSERT(ctx.alloc(64) == holes[2]);
+        ASSERT(ctx.alloc(64) == holes[0]);
+    }
+
+    return TEST_SUCCESS;
+});
+
+TEST(fit_policies_alloc_and_free,
+{
+    auto nop = [](void *, size_t) { return TEST_SUCCESS; };
+
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), fit_ctx<best_fit>>(nop, nop, 60)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), fit_ctx<good_fit<4>>>(nop, nop, 60)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), fit_ctx<next_fit>>(nop, nop, 60)));
+
+    return TEST_SUCCESS;
+});
+
+TEST(indexed_alloc_takes_smallest_fitting_block,
+{
+    using indexed_ctx = test_ctx<16, HEAP_MODE_INDEXED>;
+
+    indexed_ctx ctx(4 * PAGE_SIZE);
+
+    auto holes = make_holes(ctx, {512, 128, 1024, 96, 256});
+    ASSERT(ctx.heap.num_blocks() == 6);
+
+    ASSERT(ctx.alloc(90) == holes[3]);
+    ASSERT(ctx.alloc(200) == holes[4]);
+    ASSERT(ctx.alloc(128) == holes[1]);
+    ASSERT(ctx.alloc(600) == holes[2]);
+    ASSERT(ctx.alloc(450) == holes[0]);
+
+    auto nop = [](void *, size_t) { return TEST_SUCCESS; };
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), indexed_ctx>(nop, nop, 60)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), indexed_ctx>(nop, nop, 4000)));
+    ASSERT((generic_alloc_and_free<16, decltype(nop), decltype(nop), test_ctx<16, HEAP_MODE_INDEXED | HEAP_MODE_DOUBLY_LINKED>>(nop, nop, 277)));
+    ASSERT(check_merging<HEAP_MODE_INDEXED>());
+
+    return TEST_SUCCESS;
+});
+
+TEST(concurrent_heap_stress,
+{
+    static constexpr size_t THREADS {8};
+    static constexpr size_t OPS     {20000};
+
+    test_ctx<16, HEAP_MODE_DEFAULT, concurrent_heap<first_fit_heap<>>> ctx(256 * PAGE_SIZE);
+    const size_t free_mem_begin {ctx.heap.free_mem()};
+    std::vector<char> corrupted(THREADS, false);
+
+    auto worker = [&ctx, &corrupted](unsigned seed) {
+        struct allocation { unsigned char *p; size_t size; unsigned char pattern; };
+
+        std::mt19937 rng(seed);
+        std::vector<allocation> live;
+
+        for (size_t op = 0; op < OPS; op++) {
+            if (live.empty() or rng() % 2) {
+                const size_t size {rng() % 16 ? rng() % 256 : rng() % 2048};
+                auto *p = static_cast<unsigned char *>(ctx.alloc(size));
+
+                if (p) {
+                    const unsigned char pattern = rng();
+                    memset(p, pattern, size);
+                    live.push_back({p, size, pattern});
+                }
+            } else {
+                const size_t idx {rng() % live.size()};
+                auto &a = live[idx];
+
+                for (size_t i = 0; i < a.size; i++) {
+                    corrupted[seed] |= a.p[i] != a.pattern;
+                }
+
+                ctx.free(a.p);
+                a = live.back();
+                live.pop_back();
+            }
+        }
+
+        for (auto &a : live) {
+            ctx.free(a.p);
+        }
+
+        ctx.heap.flush();
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < THREADS; i++) {
+        threads.emplace_back(worker, i);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    ASSERT(std::find(corrupted.begin(), corrupted.end(), true) == corrupted.end());
+    ctx.heap.check_integrity();
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+
+TEST(concurrent_heap_flushes_exiting_threads,
+{
+    test_ctx<16, HEAP_MODE_DEFAULT, concurrent_heap<first_fit_heap<>>> ctx(64 * PAGE_SIZE);
+    const size_t free_mem_begin {ctx.heap.free_mem()};
+
+    // the threads leave full caches behind without calling flush()
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < 4; i++) {
+        threads.emplace_back([&ctx] {
+            std::vector<void *> ptrs;
+
+            for (size_t size = 0; size < 256; size += 8) {
+                ptrs.push_back(ctx.alloc(size));
+            }
+            for (void *p : ptrs) {
+                ctx.free(p);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    ctx.heap.check_integrity();
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+
+TEST(concurrent_heap_ignores_foreign_pointers,
+{
+    test_ctx<16, HEAP_MODE_DEFAULT, concurrent_heap<first_fit_heap<>>> ctx(64 * PAGE_SIZE);
+    const size_t free_mem_begin {ctx.heap.free_mem()};
+
+    // in front of the pointer lies what looks like the header of a small block
+    alignas(16) size_t foreign[8] {32, 0};
+    void *fake = &foreign[2];
+
+    ctx.heap.free(fake);
+
+    std::vector<void *> ptrs;
+    for (size_t i = 0; i < 64; i++) {
+        ptrs.push_back(ctx.alloc(32));
+        ASSERT(ptrs.back() != nullptr and ptrs.back() != fake);
+    }
+    for (void *p : ptrs) {
+        ctx.free(p);
+    }
+
+    ctx.heap.flush();
+    ctx.heap.check_integrity();
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+
+TEST(slab_pool_returns_empty_slabs,
+{
+    test_ctx<> ctx(256 * PAGE_SIZE);
+    const size_t free_mem_begin {ctx.heap.free_mem()};
+
+    {
+        using pool_t = slab_pool<48, first_fit_heap<>>;
+        pool_t pool(ctx.heap);
+        std::vector<void *> objects;
+
+        for (size_t i = 0; i < 3 * pool_t::objects_per_slab(); i++) {
+            void *p = pool.alloc();
+            ASSERT(p != nullptr);
+            ASSERT((reinterpret_cast<size_t>(p) & (HEAP_MIN_ALIGNMENT - 1)) == 0);
+            memset(p, 0xab, 48);
+            objects.push_back(p);
+        }
+
+        ASSERT(pool.slabs() == 3);
+
+        std::sort(objects.begin(), objects.end());
+        ASSERT(std::adjacent_find(objects.begin(), objects.end()) == objects.end());
+
+        for (void *p : objects) {
+            pool.free(p);
+        }
+
+        ASSERT(pool.slabs() == 1);
+        ctx.heap.check_integrity();
+    }
+
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+    ASSERT(ctx.heap.num_blocks() == 1);
+
+    return TEST_SUCCESS;
+});
+
+TEST(slab_pool_overhead_is_bounded,
+{
+    ASSERT(check_slab_overhead<32>());
+    ASSERT(check_slab_overhead<64>());
+    ASSERT(check_slab_overhead<128>());
+    ASSERT(check_slab_overhead<256>());
+
+    return TEST_SUCCESS;
+});
+
+TEST(object_pool_stress,
+{
+    static constexpr size_t THREADS {8};
+    static constexpr size_t OPS     {20000};
+
+    struct object
+    {
+        object(size_t val_) : val(val_), inv(~val_) {}
+        size_t val;
+        size_t inv;
+        char payload[48];
+    };
+
+    test_ctx<> ctx(256 * PAGE_SIZE);
+    const size_t free_mem_begin {ctx.heap.free_mem()};
+    std::vector<char> corrupted(THREADS, false);
+
+    {
+        object_pool<object, first_fit_heap<>> pool(ctx.heap);
+
+        auto worker = [&pool, &corrupted](unsigned seed) {
+            std::mt19937 rng(seed);
+            std::vector<object *> live;
+
+            for (size_t op = 0; op < OPS; op++) {
+                if (live.empty() or rng() % 2) {
+                    object *obj = pool.create(rng());
+
+                    if (obj) {
+                        live.push_back(obj);
+                    }
+                } else {
+                    const size_t idx {rng() % live.size()};
+
+                    corrupted[seed] |= live[idx]->inv != ~live[idx]->val;
+                    pool.destroy(live[idx]);
+                    live[idx] = live.back();
+                    live.pop_back();
+                }
+            }
+
+            for (auto *obj : live) {
+                corrupted[seed] |= obj->inv != ~obj->val;
+                pool.destroy(obj);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < THREADS; i++) {
+            threads.emplace_back(worker, i);
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    ASSERT(std::find(corrupted.begin(), corrupted.end(), true) == corrupted.end());
+    ctx.heap.check_integrity();
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+
+TEST(realloc_resizes_in_place_when_possible,
+{
+    ASSERT(check_realloc<HEAP_MODE_DEFAULT>());
+    ASSERT(check_realloc<HEAP_MODE_BINNED>());
+    ASSERT(check_realloc<HEAP_MODE_DOUBLY_LINKED>());
+    ASSERT((check_realloc<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>()));
+    ASSERT(check_realloc<HEAP_MODE_INDEXED>());
+
+    return TEST_SUCCESS;
+});
+
+TEST(alloc_aligned_returns_aligned_blocks,
+{
+    ASSERT(check_alloc_aligned<HEAP_MODE_DEFAULT>());
+    ASSERT(check_alloc_aligned<HEAP_MODE_BINNED>());
+    ASSERT(check_alloc_aligned<HEAP_MODE_DOUBLY_LINKED>());
+    ASSERT((check_alloc_aligned<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>()));
+    ASSERT(check_alloc_aligned<HEAP_MODE_INDEXED>());
+    ASSERT(check_alloc_aligned<HEAP_MODE_COMPACT>());
+    ASSERT((check_alloc_aligned<HEAP_MODE_INDEXED | HEAP_MODE_COMPACT>()));
+
+    return TEST_SUCCESS;
+});
+
+TEST(alloc_aligned_uses_blocks_just_large_enough,
+{
+    // a hole that only fits the request at its aligned address
+    __attribute__((aligned(PAGE_SIZE))) static char buffer[4 * PAGE_SIZE];
+
+    fixed_memory mem(size_t(buffer), sizeof(buffer));
+    first_fit_heap<> heap(mem);
+
+    void *front = heap.alloc(PAGE_SIZE - 64 - 16);
+    void *hole  = heap.alloc(PAGE_SIZE + 64 - 16);
+    void *back  = heap.alloc(2 * PAGE_SIZE - 16 - 16);
+    ASSERT(front and hole and back);
+    ASSERT(heap.free_mem() == 0);
+
+    heap.free(hole);
+
+    void *p = heap.alloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    ASSERT(p == buffer + PAGE_SIZE);
+    ASSERT(heap.alloc_aligned(16, PAGE_SIZE) == nullptr);
+
+    heap.free(p);
+    heap.free(front);
+    heap.free(back);
+    ASSERT(heap.num_blocks() == 1);
+
+    return TEST_SUCCESS;
+});
+
+TEST(heap_grows_when_exhausted,
+{
+    ASSERT(check_growth<HEAP_MODE_DEFAULT>());
+    ASSERT(check_growth<HEAP_MODE_BINNED>());
+    ASSERT(check_growth<HEAP_MODE_DOUBLY_LINKED>());
+    ASSERT((check_growth<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>()));
+    ASSERT(check_growth<HEAP_MODE_INDEXED>());
+    ASSERT((check_growth<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED | HEAP_MODE_COMPACT>()));
+
+    return TEST_SUCCESS;
+});
+
+TEST(oversized_requests_fail,
+{
+    // volatile keeps the compiler from folding the calls
+    static volatile size_t sizes[] {~0ul, ~0ul - 7, ~0ul >> 1};
+
+    growable_memory mem(64 << 20, PAGE_SIZE);
+    first_fit_heap<HEAP_MIN_ALIGNMENT, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED> heap(mem);
+    test_ctx<> ctx(PAGE_SIZE);
+
+    for (size_t size : sizes) {
+        void *out[2];
+
+        ASSERT(heap.alloc(size) == nullptr);
+        ASSERT(heap.alloc_n(size, 2, out) == 0);
+        ASSERT(ctx.heap.alloc(size) == nullptr);
+        ASSERT(ctx.heap.alloc_n(size, 2, out) == 0);
+    }
+
+    heap.check_integrity();
+    ASSERT(heap.num_blocks() == 1);
+
+    // the same through malloc, which is the preloaded heap in the second run
+    void *kept = malloc(100);
+    ASSERT(kept != nullptr);
+
+    for (size_t size : sizes) {
+        void *p {nullptr};
+
+        errno = 0;
+        ASSERT(malloc(size) == nullptr and errno == ENOMEM);
+
+        errno = 0;
+        ASSERT(calloc(size, 1) == nullptr and errno == ENOMEM);
+
+        errno = 0;
+        ASSERT(realloc(kept, size) == nullptr and errno == ENOMEM);
+
+        ASSERT(posix_memalign(&p, 16, size) == ENOMEM);
+    }
+
+    free(kept);
+    return TEST_SUCCESS;
+});
+
+TEST(pvalloc_returns_whole_pages,
+{
+    void *p = pvalloc(100);
+
+    ASSERT(p != nullptr and (reinterpret_cast<size_t>(p) & (PAGE_SIZE - 1)) == 0);
+    ASSERT(malloc_usable_size(p) >= PAGE_SIZE);
+
+    free(p);
+    return TEST_SUCCESS;
+});
+
+TEST(preloaded_malloc_ignores_foreign_pointers,
+{
+    const char *preload {getenv("LD_PRELOAD")};
+
+    // glibc would take the pointer for one of its own blocks
+    if (not preload or not strstr(preload, "first-fit-heap-preload")) {
+        return TEST_SUCCESS;
+    }
+
+    // memory of another allocator, in front of the pointer lies what looks
+    // like the header of a huge block
+    void *region = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(region != MAP_FAILED);
+    memset(region, 0x7f, PAGE_SIZE);
+
+    // volatile hides the origin from the compiler's free checks
+    void *volatile foreign = static_cast<char *>(region) + 64;
+
+    ASSERT(malloc_usable_size(foreign) == 0);
+
+    errno = 0;
+    ASSERT(realloc(foreign, 100) == nullptr and errno == ENOMEM);
+
+    free(foreign);
+    munmap(region, PAGE_SIZE);
+    return TEST_SUCCESS;
+});
+
+TEST(batched_alloc_and_free,
+{
+    ASSERT(check_batch<HEAP_MODE_DEFAULT>());
+    ASSERT((check_batch<HEAP_MODE_DEFAULT, next_fit>()));
+    ASSERT((check_batch<HEAP_MODE_DEFAULT, best_fit>()));
+    ASSERT(check_batch<HEAP_MODE_BINNED>());
+    ASSERT(check_batch<HEAP_MODE_DOUBLY_LINKED>());
+    ASSERT((check_batch<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>()));
+    ASSERT(check_batch<HEAP_MODE_INDEXED>());
+    ASSERT(check_batch<HEAP_MODE_COMPACT>());
+    ASSERT((check_batch<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED | HEAP_MODE_COMPACT>()));
+
+    return TEST_SUCCESS;
+});
+
+TEST(trim_releases_free_pages,
+{
+    growable_memory mem(64 << 20, 8 << 20);
+    first_fit_heap<> heap(mem);
+
+    void *big   = heap.alloc(4 << 20);
+    void *guard = heap.alloc(16);
+    memset(big, 0xff, 4 << 20);
+    heap.free(big);
+
+    ASSERT(heap.released_mem() == 0);
+    ASSERT(resident_pages(big, 4 << 20) >= (4 << 20) / PAGE_SIZE);
+
+    const size_t released {heap.trim()};
+    ASSERT(released > 4 << 20);
+    ASSERT(heap.released_mem() == released);
+    ASSERT(heap.resident_mem() == mem.size() - released);
+    ASSERT(resident_pages(big, 4 << 20) <= 3);
+    ASSERT(heap.trim() == 0);
+
+    // metadata survived, the block can be merged and allocated again
+    heap.check_integrity();
+    heap.free(guard);
+    ASSERT(heap.num_blocks() == 1);
+    ASSERT(heap.released_mem() == 0);
+
+    big = heap.alloc(4 << 20);
+    memset(big, 0xff, 4 << 20);
+    heap.free(big);
+
+    return TEST_SUCCESS;
+});
+
+TEST(trim_threshold_releases_on_free,
+{
+    growable_memory mem(64 << 20, 8 << 20);
+    first_fit_heap<HEAP_MIN_ALIGNMENT, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED> heap(mem);
+
+    heap.trim_threshold(1 << 20);
+
+    void *a     = heap.alloc(256 << 10);
+    void *b     = heap.alloc(256 << 10);
+    void *guard = heap.alloc(16);
+    void *tail  = heap.alloc(heap.free_mem() - 64);
+
+    // small merged blocks stay resident
+    heap.free(a);
+    ASSERT(heap.released_mem() == 0);
+    heap.free(b);
+    ASSERT(heap.released_mem() == 0);
+
+    heap.free(tail);
+    ASSERT(heap.released_mem() > 0);
+
+    heap.free(guard);
+    ASSERT(heap.released_mem() > 7 << 20);
+    ASSERT(heap.num_blocks() == 1);
+
+    return TEST_SUCCESS;
+});
+
+TEST(huge_allocations_bypass_the_heap,
+{
+    growable_memory mem(64 << 20, 1 << 20);
+    first_fit_heap<> heap(mem);
+    const auto free_mem_begin {heap.free_mem()};
+
+    heap.huge_threshold(256 << 10);
+
+    auto in_heap = [&mem](void *p) { return size_t(p) >= mem.base() and size_t(p) < mem.end(); };
+
+    void *small = heap.alloc(1024);
+    void *huge  = heap.alloc(4 << 20);
+    void *other = heap.alloc(1 << 20);
+    ASSERT(small and huge and other);
+
+    ASSERT(not in_heap(huge) and not in_heap(other));
+    ASSERT(heap.ptr_in_range(huge) and heap.ptr_in_range(small));
+    ASSERT((reinterpret_cast<size_t>(huge) & (heap.alignment() - 1)) == 0);
+    ASSERT(heap.usable_size(huge) >= 4 << 20);
+    ASSERT(heap.mapped_mem() >= 5 << 20);
+    ASSERT(mem.size() == 1 << 20);
+
+    memset(huge, 0x11, 4 << 20);
+    heap.check_integrity();
+
+    // shrinking below the threshold moves the data into the heap
+    void *moved = heap.realloc(huge, 1000);
+    ASSERT(in_heap(moved));
+    ASSERT(static_cast<unsigned char *>(moved)[999] == 0x11);
+    ASSERT(heap.mapped_mem() < 2 << 20);
+
+    // memory laid out like a huge block, but not mapped by the heap
+    const size_t offset {reinterpret_cast<size_t>(other) & (PAGE_SIZE - 1)};
+    void *region = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(region != MAP_FAILED);
+    memcpy(region, static_cast<char *>(other) - offset, offset);
+
+    void *lookalike = static_cast<char *>(region) + offset;
+    ASSERT(not heap.ptr_in_range(lookalike));
+    heap.free(lookalike);
+    ASSERT(heap.mapped_mem() > 1 << 20);
+    munmap(region, PAGE_SIZE);
+
+    heap.free(other);
+    ASSERT(heap.mapped_mem() == 0);
+
+    // unknown pointers are ignored as before
+    char foreign[32];
+    heap.free(foreign + 16);
+
+    heap.free(moved);
+    heap.free(small);
+    ASSERT(heap.num_blocks() == 1);
+    ASSERT(heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+
+TEST(huge_allocations_stay_aligned,
+{
+    ASSERT((check_huge_alignment<16, HEAP_MODE_DEFAULT>()));
+    ASSERT((check_huge_alignment<16, HEAP_MODE_COMPACT>()));
+    ASSERT((check_huge_alignment<32, HEAP_MODE_COMPACT>()));
+    ASSERT((check_huge_alignment<64, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED | HEAP_MODE_COMPACT>()));
+
+    return TEST_SUCCESS;
+});
+
+TEST(stats_follow_alloc_and_free,
+{
+    if (not HEAP_STATS) {
+        return TEST_SUCCESS;
+    }
+
+    test_ctx<16, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED> ctx(64 * PAGE_SIZE);
+    const auto begin {ctx.heap.stats()};
+
+    ASSERT(begin.free_blocks == 1);
+    ASSERT(begin.free_bytes == 64 * PAGE_SIZE - 16);
+    ASSERT(ctx.heap.largest_free_block() == begin.free_bytes);
+    ASSERT(ctx.heap.fragmentation() == 0.);
+
+    auto holes = make_holes(ctx, {256, 512, 1024});
+    auto *p = ctx.alloc(100);
+    ASSERT(ctx.heap.realloc(p, 200) == p);
+
+    auto stats = ctx.heap.stats();
+    ASSERT(stats.allocs == 7);
+    ASSERT(stats.frees == 3);
+    ASSERT(stats.free_blocks == 4);
+    ASSERT(stats.used_bytes >= 3 * 16 + 200);
+    ASSERT(stats.peak_used >= 256 + 512 + 1024 + 3 * 16);
+    // every block but the initial one adds a header
+    ASSERT(stats.free_bytes + stats.used_bytes + 7 * 16 == begin.free_bytes);
+    ASSERT(ctx.heap.fragmentation() > 0.);
+    ctx.heap.check_integrity();
+
+    ASSERT(ctx.alloc(128 * PAGE_SIZE) == nullptr);
+    ASSERT(ctx.heap.stats().failed == 1);
+
+    size_t bins[64];
+    ctx.heap.histogram(bins);
+    ASSERT(bins[9] == 1 and bins[10] == 1);
+    ASSERT(std::accumulate(std::begin(bins), std::end(bins), 0ul) == stats.free_blocks);
+
+    return TEST_SUCCESS;
+});
+
+TEST(trace_records_alloc_and_free,
+{
+    char path[] {"/tmp/first-fit-heap-trace-XXXXXX"};
+    close(mkstemp(path));
+
+    {
+        std::vector<char> buffer(64 * PAGE_SIZE);
+        fixed_memory heap_mem(reinterpret_cast<size_t>(buffer.data() + 15) & ~15ul, 63 * PAGE_SIZE);
+
+        // a small ring buffer drains several times
+        traced_heap<first_fit_heap<>> traced(heap_mem, path, 8);
+        std::vector<void *> ptrs;
+
+        for (size_t i = 0; i < 20; i++) {
+            ptrs.push_back(traced.alloc(16 * (i + 1)));
+        }
+
+        ptrs[3] = traced.realloc(ptrs[3], 1024);
+
+        for (auto *p : ptrs) {
+            traced.free(p);
+        }
+
+        // blocks the trace does not know are passed on, a realloc adds
+        // them to the trace
+        void *untraced = traced.heap().alloc(64);
+        traced.free(untraced);
+
+        int foreign;
+        traced.free(&foreign);
+
+        untraced = traced.realloc(traced.heap().alloc(64), 4096);
+        ASSERT(untraced != nullptr);
+        traced.free(untraced);
+
+        ASSERT(traced.heap().num_blocks() == 1);
+    }
+
+    std::vector<heap_trace_record> records;
+    ASSERT(read_heap_trace(path, records));
+    unlink(path);
+
+    ASSERT(records.size() == 43);
+    ASSERT(records[41].op == heap_trace_record::ALLOC and records[41].handle == 20 and records[41].size == 4096);
+    ASSERT(records[42].op == heap_trace_record::FREE and records[42].handle == 20);
+
+    for (uint32_t i = 0; i < 20; i++) {
+        ASSERT(records[i].op == heap_trace_record::ALLOC);
+        ASSERT(records[i].handle == i and records[i].size == 16 * (i + 1));
+        ASSERT(records[21 + i].op == heap_trace_record::FREE and records[21 + i].handle == i);
+    }
+
+    ASSERT(records[20].op == heap_trace_record::REALLOC);
+    ASSERT(records[20].handle == 3 and records[20].size == 1024);
+    ASSERT(std::is_sorted(records.begin(), records.end(),
+                          [](const heap_trace_record &a, const heap_trace_record &b) { return a.timestamp < b.timestamp; }));
+
+    return TEST_SUCCESS;
+});
+
+#ifdef TEST_HEAP_RESOURCE
+TEST(pmr_containers_use_the_heap,
+{
+    test_ctx<> ctx(256 * PAGE_SIZE);
+    const auto free_mem_begin {ctx.heap.free_mem()};
+
+    first_fit_memory_resource<first_fit_heap<>> resource(ctx.heap);
+
+    {
+        std::pmr::vector<int> vec(&resource);
+        std::pmr::unordered_map<int, std::pmr::string> map(&resource);
+
+        for (int i = 0; i < 1000; i++) {
+            vec.push_back(i);
+            map.emplace(i, std::pmr::string(64, 'a' + i % 26));
+        }
+
+        ASSERT(ctx.heap.ptr_in_range(vec.data()));
+        ASSERT(ctx.heap.ptr_in_range(const_cast<char *>(map.at(500).data())));
+        ASSERT(std::accumulate(vec.begin(), vec.end(), 0) == 999 * 1000 / 2);
+        ASSERT(map.at(27) == std::pmr::string(64, 'b'));
+        ASSERT(ctx.heap.free_mem() < free_mem_begin);
+
+        // the alignment argument is honoured
+        for (size_t alignment = 16; alignment <= PAGE_SIZE; alignment *= 2) {
+            void *p = resource.allocate(100, alignment);
+            ASSERT((reinterpret_cast<size_t>(p) & (alignment - 1)) == 0);
+            resource.deallocate(p, 100, alignment);
+        }
+
+        ctx.heap.check_integrity();
+    }
+
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    first_fit_memory_resource<first_fit_heap<>> same(ctx.heap);
+    ASSERT(resource == same);
+    ASSERT(resource != *std::pmr::new_delete_resource());
+
+    bool thrown {false};
+    try {
+        [[maybe_unused]] void *p = resource.allocate(512 * PAGE_SIZE);
+    } catch (std::bad_alloc &) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    return TEST_SUCCESS;
+});
+
+TEST(allocator_serves_standard_containers,
+{
+    test_ctx<> ctx(256 * PAGE_SIZE);
+    const auto free_mem_begin {ctx.heap.free_mem()};
+
+    first_fit_allocator<int> alloc(ctx.heap);
+
+    {
+        std::vector<int, first_fit_allocator<int>> vec(alloc);
+        std::list<int, first_fit_allocator<int>> list(alloc);
+        std::map<int, int, std::less<int>, first_fit_allocator<std::pair<const int, int>>> map(alloc);
+
+        for (int i = 0; i < 1000; i++) {
+            vec.push_back(i);
+            list.push_front(i);
+            map[i] = -i;
+        }
+
+        ASSERT(ctx.heap.ptr_in_range(vec.data()));
+        ASSERT(ctx.heap.ptr_in_range(&list.front()));
+        ASSERT(ctx.heap.ptr_in_range(&map.at(10)));
+        ASSERT(list.front() == 999 and map.at(10) == -10);
+
+        // rebound copies share the heap
+        first_fit_allocator<double> rebound(alloc);
+        ASSERT(rebound == alloc);
+        ASSERT(&rebound.heap() == &ctx.heap);
+
+        struct alignas(256) wide { char c; };
+        first_fit_allocator<wide> wide_alloc(alloc);
+        wide *w = wide_alloc.allocate(3);
+        ASSERT((reinterpret_cast<size_t>(w) & 255) == 0);
+        wide_alloc.deallocate(w, 3);
+
+        ctx.heap.check_integrity();
+    }
+
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+#endif
+
+TEST(static_memory_heap_alloc_and_free,
+{
+    bool mapped {false};
+
+    // low addresses are left to the application by sanitizers and by
+    // kernels with a small address space
+    ASSERT(check_static_memory<0x10000000ul>(mapped));
+    ASSERT(mapped or check_static_memory<0x2000000000ul>(mapped));
+
+    if (not mapped) {
+        TRACE("skipped, no fixed address could be mapped");
+    }
+
+    return TEST_SUCCESS;
+});
+
+TEST(compact_headers_take_one_word,
+{
+    test_ctx<16, HEAP_MODE_COMPACT> ctx(64 * PAGE_SIZE);
+    const auto free_mem_begin {ctx.heap.free_mem()};
+    std::vector<void *> ptrs;
+    std::mt19937 rng(5);
+
+    // a header slot in front of the first and behind the last block
+    ASSERT(free_mem_begin == 64 * PAGE_SIZE - 24);
+
+    // 24 byte objects take 32 bytes and stay aligned
+    for (size_t i = 0; i < 100; i++) {
+        void *p = ctx.alloc(24);
+
+        ASSERT((reinterpret_cast<size_t>(p) & 15) == 0);
+        ASSERT(ctx.heap.usable_size(p) == 24);
+        ASSERT(i == 0 or p == static_cast<char *>(ptrs.back()) + 32);
+        memset(p, 0x5a, 24);
+        ptrs.push_back(p);
+    }
+
+    ctx.heap.check_integrity();
+
+    std::shuffle(ptrs.begin(), ptrs.end(), rng);
+    for (auto *p : ptrs) {
+        ctx.free(p);
+    }
+
+    ASSERT(ctx.heap.num_blocks() == 1);
+    ASSERT(ctx.heap.free_mem() == free_mem_begin);
+
+    // the canary in the size word still catches overwritten headers
+    void *p = ctx.alloc(24);
+    static_cast<char *>(p)[-2] ^= 0x10;
+
+    try {
+        ctx.heap.check_integrity();
+    } catch (std::exception &) {
+        return TEST_SUCCESS;
+    }
+    return TEST_FAILED;
+});
+
+TEST(deferred_frees_use_quick_lists,
+{
+    ASSERT(check_deferred<HEAP_MODE_DEFAULT>());
+    ASSERT(check_deferred<HEAP_MODE_BINNED>());
+    ASSERT((check_deferred<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>()));
+    ASSERT(check_deferred<HEAP_MODE_INDEXED>());
+    ASSERT((check_deferred<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED | HEAP_MODE_COMPACT>()));
+
+    return TEST_SUCCESS;
+});
+
+TEST(deferred_double_free_is_caught,
+{
+    test_ctx<16, HEAP_MODE_DEFERRED> ctx(PAGE_SIZE);
+
+    void *p = ctx.alloc(32);
+    ctx.free(p);
+
+    try {
+        ctx.free(p);
+    } catch (std::exception &) {
+        return TEST_SUCCESS;
+    }
+    return TEST_FAILED;
+});
+
+TEST(persistent_heap_reopens_at_another_address,
+{
+    ASSERT(check_persistent<HEAP_MODE_DEFAULT>());
+    ASSERT((check_persistent<HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>()));
+    ASSERT(check_persistent<HEAP_MODE_INDEXED>());
+    ASSERT((check_persistent<HEAP_MODE_COMPACT | HEAP_MODE_DEFERRED>()));
+
+    return TEST_SUCCESS;
+});
+
+TEST(shared_heap_across_processes,
+{
+    static constexpr size_t WORKERS {4};
+
+    const int fd {memfd_create("first-fit-heap-shared", MFD_CLOEXEC)};
+    shared_heap<> heap(fd, 1024 * PAGE_SIZE);
+    ASSERT(heap.valid());
+
+    const size_t free_mem_begin {heap.free_mem()};
+
+    int channel[2];
+    ASSERT(pipe(channel) == 0);
+
+    std::vector<pid_t> workers;
+    for (size_t i = 1; i <= WORKERS; i++) {
+        const pid_t pid {fork()};
+
+        if (pid == 0) {
+            close(channel[0]);
+            _exit(shared_heap_worker(fd, i, channel[1]) ? 0 : 1);
+        }
+
+        ASSERT(pid > 0);
+        workers.push_back(pid);
+    }
+
+    close(channel[1]);
+
+    // blocks sent over are read in place and freed here while the workers go on
+    size_t offset, received {0};
+    while (read(channel[0], &offset, sizeof(offset)) == sizeof(offset)) {
+        auto *b = static_cast<shared_block *>(heap.at(offset));
+
+        ASSERT(b->intact() and b->worker >= 1 and b->worker <= WORKERS);
+        heap.free(b);
+        received++;
+    }
+
+    close(channel[0]);
+
+    for (auto pid : workers) {
+        int status;
+        ASSERT(waitpid(pid, &status, 0) == pid);
+        ASSERT(WIFEXITED(status) and WEXITSTATUS(status) == 0);
+    }
+
+    ASSERT(received > WORKERS * 100);
+    ASSERT(heap.verify());
+    heap.check_integrity();
+    ASSERT(heap.num_blocks() == 1);
+    ASSERT(heap.free_mem() == free_mem_begin);
+
+    close(fd);
+    return TEST_SUCCESS;
+});
+
+TEST(shared_heap_survives_dead_lock_owner,
+{
+    const int fd {memfd_create("first-fit-heap-shared", MFD_CLOEXEC)};
+    shared_heap<> heap(fd, 64 * PAGE_SIZE);
+    ASSERT(heap.valid());
+
+    // a process that exits while holding the lock
+    auto die_locked = [fd](bool modify) {
+        const pid_t pid {fork()};
+
+        if (pid == 0) {
+            shared_heap<> own(fd);
+
+            own.locked([modify](shared_heap<>::heap_type &h) {
+                if (modify) {
+                    h.alloc(100);
+                }
+                _exit(0);
+            });
+            _exit(1);
+        }
+
+        int status;
+        return waitpid(pid, &status, 0) == pid and WIFEXITED(status) and WEXITSTATUS(status) == 0;
+    };
+
+    void *kept = heap.alloc(100);
+    ASSERT(kept != nullptr);
+
+    // nothing was changed, the heap goes on
+    ASSERT(die_locked(false));
+
+    void *p = heap.alloc(100);
+    ASSERT(p != nullptr and not heap.broken());
+    heap.free(p);
+    ASSERT(heap.num_blocks() == 1);
+
+    // the roots were not written back after the allocation
+    ASSERT(die_locked(true));
+    ASSERT(heap.alloc(100) == nullptr);
+    ASSERT(heap.broken());
+    ASSERT(not (shared_heap<>(fd).valid()));
+
+    close(fd);
+    return TEST_SUCCESS;
+});
+
+TEST(shared_heap_attaches_by_name,
+{
+    using heap_type = shared_heap<16, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>;
+
+    const std::string name {"/first-fit-heap-" + std::to_string(getpid())};
+
+    heap_type creator(name.c_str(), 64 * PAGE_SIZE);
+    ASSERT(creator.valid());
+
+    // the name is taken, heaps of another type do not attach
+    ASSERT(not heap_type(name.c_str(), 64 * PAGE_SIZE).valid());
+    ASSERT(not (shared_heap<32, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>(name.c_str()).valid()));
+    ASSERT(not shared_heap<>(name.c_str()).valid());
+
+    heap_type other(name.c_str());
+    ASSERT(other.valid() and other.at(0) != creator.at(0));
+
+    auto *msg = static_cast<char *>(creator.alloc(64));
+    strcpy(msg, "read in place");
+    creator.root(msg);
+
+    auto *seen = static_cast<char *>(other.root());
+    ASSERT(seen != msg and strcmp(seen, "read in place") == 0);
+
+    other.free(seen);
+    other.root(nullptr);
+    ASSERT(creator.root() == nullptr);
+    ASSERT(creator.num_blocks() == 1);
+
+    shm_unlink(name.c_str());
+    return TEST_SUCCESS;
+});
+
+TEST(arena_heap_spills_to_other_arenas,
+{
+    std::vector<char> buffer(4 * 16 * PAGE_SIZE + PAGE_SIZE);
+    fixed_memory mem((reinterpret_cast<size_t>(buffer.data()) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1), 4 * 16 * PAGE_SIZE);
+    arena_heap<first_fit_heap<>> heap(mem, 4, arena_select::ROUND_ROBIN);
+
+    const size_t free_mem_begin {heap.free_mem()};
+    std::vector<void *> ptrs;
+
+    ASSERT(heap.arenas() == 4);
+    ASSERT(heap.num_blocks() == 4);
+
+    // the first arena fills up, then the others are used
+    void *first = heap.alloc(1000);
+    ASSERT(first != nullptr);
+
+    const size_t own {heap.arena_of(first)};
+    ptrs.push_back(first);
+
+    while (void *p = heap.alloc(1000)) {
+        ptrs.push_back(p);
+    }
+
+    std::vector<size_t> per_arena(heap.arenas());
+    for (auto *p : ptrs) {
+        per_arena[heap.arena_of(p)]++;
+    }
+
+    ASSERT(std::all_of(per_arena.begin(), per_arena.end(), [](size_t n) { return n > 50; }));
+    ASSERT(std::is_sorted(ptrs.begin(), ptrs.begin() + per_arena[own]));
+    heap.check_integrity();
+
+    // realloc moves to another arena when the own one is full
+    heap.free(ptrs.back());
+    ptrs.pop_back();
+    heap.free(ptrs.back());
+    ptrs.pop_back();
+
+    memset(ptrs[0], 0x5a, 1000);
+    void *grown = heap.realloc(ptrs[0], 2000);
+    ASSERT(grown != nullptr and heap.arena_of(grown) != own);
+    ASSERT(static_cast<char *>(grown)[999] == 0x5a);
+    ptrs[0] = grown;
+
+    // pointers outside the arenas belong to none
+    alignas(16) char foreign[64];
+    ASSERT(heap.usable_size(foreign + 32) == 0 and heap.arena_of(foreign + 32) == heap.arenas());
+    ASSERT(heap.arena_of(buffer.data() + buffer.size() - 1) == heap.arenas());
+
+    for (auto *p : ptrs) {
+        heap.free(p);
+    }
+
+    ASSERT(heap.num_blocks() == 4);
+    ASSERT(heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+
+TEST(arena_heap_defers_remote_frees,
+{
+    std::vector<char> buffer(2 * 16 * PAGE_SIZE + PAGE_SIZE);
+    fixed_memory mem((reinterpret_cast<size_t>(buffer.data()) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1), 2 * 16 * PAGE_SIZE);
+    arena_heap<first_fit_heap<>, counting_lock> heap(mem, 2, arena_select::ROUND_ROBIN);
+
+    const size_t free_mem_begin {heap.free_mem()};
+    std::vector<void *> ptrs;
+    size_t own {0};
+
+    // consecutive new threads get alternating arenas
+    std::thread([&] {
+        ptrs.push_back(heap.alloc(100));
+        own = heap.arena_of(ptrs[0]);
+
+        for (size_t i = 0; i < 100; i++) {
+            ptrs.push_back(heap.alloc(100));
+        }
+    }).join();
+
+    ASSERT(std::all_of(ptrs.begin(), ptrs.end(), [&](void *p) { return p and heap.arena_of(p) == own; }));
+
+    // the frees of another thread do not touch the owner's lock
+    const size_t taken {counting_lock::taken};
+
+    std::thread([&] {
+        for (auto *p : ptrs) {
+            heap.free(p);
+        }
+    }).join();
+
+    ASSERT(counting_lock::taken == taken);
+
+    // the owner takes the blocks back on its next alloc
+    void *reused {nullptr};
+
+    std::thread([&] {
+        reused = heap.alloc(100);
+        heap.free(reused);
+    }).join();
+
+    ASSERT(reused == ptrs[0]);
+
+    heap.check_integrity();
+    ASSERT(heap.num_blocks() == 2);
+    ASSERT(heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
+
+TEST(arena_heap_stress,
+{
+    static constexpr size_t THREADS {8};
+    static constexpr size_t BLOCKS  {2000};
+
+    std::vector<char> buffer(1024 * PAGE_SIZE + PAGE_SIZE);
+    fixed_memory mem((reinterpret_cast<size_t>(buffer.data()) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1), 1024 * PAGE_SIZE);
+    arena_heap<first_fit_heap<16, HEAP_MODE_BINNED | HEAP_MODE_DOUBLY_LINKED>> heap(mem, 4);
+
+    const size_t free_mem_begin {heap.free_mem()};
+    std::vector<std::vector<void *>> blocks(THREADS);
+    std::vector<char> corrupted(THREADS, false);
+
+    auto run = [](std::function<void(unsigned)> fn) {
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < THREADS; i++) {
+            threads.emplace_back(fn, i);
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    };
+
+    // every thread allocates and frees some of its blocks again
+    run([&](unsigned id) {
+        std::mt19937 rng(id);
+
+        for (size_t i = 0; i < BLOCKS; i++) {
+            const size_t size {16 + rng() % 240};
+            auto *p = static_cast<unsigned char *>(heap.alloc(size));
+
+            if (p) {
+                memset(p, id, 16);
+                corrupted[id] |= heap.usable_size(p) < size;
+
+                // resized while the other threads merge around it
+                if (i % 8 == 0) {
+                    auto *resized = static_cast<unsigned char *>(heap.realloc(p, 2 * size));
+
+                    if (resized) {
+                        corrupted[id] |= resized[15] != id or heap.usable_size(resized) < 2 * size;
+                        p = resized;
+                    }
+                }
+
+                blocks[id].push_back(p);
+            }
+
+            if (rng() % 4 == 0 and not blocks[id].empty()) {
+                heap.free(blocks[id].back());
+                blocks[id].pop_back();
+            }
+        }
+    });
+
+    // the rest is freed by another thread
+    run([&](unsigned id) {
+        const unsigned owner = (id + 1) % THREADS;
+
+        for (auto *p : blocks[owner]) {
+            corrupted[id] |= static_cast<unsigned char *>(p)[15] != owner;
+            heap.free(p);
+        }
+    });
+
+    ASSERT(std::find(corrupted.begin(), corrupted.end(), true) == corrupted.end());
+    heap.check_integrity();
+    ASSERT(heap.num_blocks() == 4);
+    ASSERT(heap.free_mem() == free_mem_begin);
+
+    return TEST_SUCCESS;
+});
 
 TEST_SUITE_END
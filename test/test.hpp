@@ -7,16 +7,18 @@ static constexpr bool TEST_FAILED  {false};
 #define TEST_SUITE_START   \
     int main(int, char **) \
     {                      \
-        bool ok {true};
+        bool ok {true};    \
+        bool all_ok {true};
 
-#define TEST_SUITE_END      \
-        return ok ? 0 : -1; \
+#define TEST_SUITE_END          \
+        return all_ok ? 0 : -1; \
     }
 
 #define TEST(name, ...)                  \
     auto test_##name = []() __VA_ARGS__; \
     ok &= test_##name();                  \
     printf("[%s] " #name "\n", ok ? "  OK  " : "FAILED"); \
+    all_ok &= ok;                         \
     ok = true;
 
 #define ASSERT(x)                             \